@@ -4,22 +4,44 @@
 #include <fcntl.h>
 #include <limits.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/select.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
 #include "console.h"
 #include "report.h"
 #include "web.h"
 
+/* Only for allocation statistics, console uses regular malloc/free */
+#define INTERNAL 1
+#include "harness.h"
+
 /* Some global values */
 int simulation = 0;
 int show_entropy = 0;
 static cmd_element_t *cmd_list = NULL;
 static param_element_t *param_list = NULL;
+
+/* Commands and parameters are also kept in open-addressing hash tables, so
+ * that looking one up by name does not walk the sorted lists. Both element
+ * types start with their name, which is all the tables look at.
+ */
+#define NAME_TABLE_SIZE 256
+static void *cmd_table[NAME_TABLE_SIZE];
+static void *param_table[NAME_TABLE_SIZE];
+static int cmd_count = 0, param_count = 0;
 static bool block_flag = false;
 static bool prompt_flag = true;
 
@@ -33,17 +55,23 @@ static double first_time, last_time;
  * Must create stack of buffers to handle I/O with nested source commands.
  */
 
-#define RIO_BUFSIZE 8192
+#define RIO_BUFSIZE 65536
 
+/* Regular files are mapped instead, bufptr and count then covering the part
+ * of the mapping not read yet.
+ */
 typedef struct __rio {
     int fd;                /* File descriptor */
-    int count;             /* Unread bytes in internal buffer */
+    size_t count;          /* Unread bytes in internal buffer */
     char *bufptr;          /* Next unread byte in internal buffer */
+    char *map;             /* Mapped file, or NULL */
+    size_t map_size;       /* Size of mapped file */
     char buf[RIO_BUFSIZE]; /* Internal buffer */
     struct __rio *prev;    /* Next element in stack */
 } rio_t;
 
 static rio_t *buf_stack;
+/* Last line of a file, which outlives the buffer it was read into */
 static char linebuf[RIO_BUFSIZE];
 
 /* Maximum file descriptor */
@@ -65,13 +93,67 @@ static bool has_infile = false;
 static cmd_func_t quit_helpers[MAXQUIT];
 static int quit_helper_cnt = 0;
 
+static count_func_t element_counter = NULL;
+
+/* Records of commands run, as a JSON array */
+static FILE *json_file = NULL;
+static bool json_first = true;
+
 static void init_in();
 
 static bool push_file(char *fname);
 static void pop_file();
+static void run_sources(rio_t *outer);
+
+static bool is_compiled_trace(char *fname);
+static bool run_compiled_trace(char *fname);
 
 static bool interpret_cmda(int argc, char *argv[]);
 
+static unsigned name_hash(const char *name)
+{
+    /* FNV-1a */
+    unsigned hash = 2166136261u;
+    while (*name) {
+        hash ^= (unsigned char) *name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/* Return the slot holding name, or the empty one it belongs in */
+static unsigned name_slot(void *table[], const char *name)
+{
+    unsigned i = name_hash(name) & (NAME_TABLE_SIZE - 1);
+    while (table[i] && strcmp(*(char **) table[i], name) != 0)
+        i = (i + 1) & (NAME_TABLE_SIZE - 1);
+    return i;
+}
+
+/* Enter element under name, replacing any element of that name */
+static void name_insert(void *table[], int *count, const char *name,
+                        void *element)
+{
+    /* Keep the load factor under one half for short probe sequences */
+    if (*count >= NAME_TABLE_SIZE / 2)
+        report_event(MSG_FATAL, "Too many commands or parameters");
+
+    unsigned i = name_slot(table, name);
+    if (!table[i])
+        (*count)++;
+    table[i] = element;
+}
+
+static cmd_element_t *find_cmd(const char *name)
+{
+    return cmd_table[name_slot(cmd_table, name)];
+}
+
+static param_element_t *find_param(const char *name)
+{
+    return param_table[name_slot(param_table, name)];
+}
+
 /* Add a new command */
 void add_cmd(char *name, cmd_func_t operation, char *summary, char *param)
 {
@@ -89,6 +171,7 @@ void add_cmd(char *name, cmd_func_t operation, char *summary, char *param)
     cmd->param = param;
     cmd->next = next_cmd;
     *last_loc = cmd;
+    name_insert(cmd_table, &cmd_count, name, cmd);
 }
 
 /* Add a new parameter */
@@ -109,26 +192,36 @@ void add_param(char *name, int *valp, char *summary, setter_func_t setter)
     param->setter = setter;
     param->next = next_param;
     *last_loc = param;
+    name_insert(param_table, &param_count, name, param);
 }
 
-/* Parse a string into a command line */
-static char **parse_args(char *line, int *argcp)
+/* Command lines are split into parse_buf, with argv taken from parse_argv.
+ * Both are reused for every line, so that interpreting one allocates nothing.
+ * A line interpreted while another one is running takes the space past it.
+ */
+#define PARSE_BUFSIZE (2 * RIO_BUFSIZE)
+static char parse_buf[PARSE_BUFSIZE];
+/* Every word takes at least two bytes of parse_buf, with its terminator */
+static char *parse_argv[PARSE_BUFSIZE / 2];
+static size_t parse_used = 0;
+static int parse_argc = 0;
+
+/* Parse len bytes of line into a command line, return NULL if they do not
+ * fit
+ */
+static char **parse_args(const char *line, size_t len, int *argcp)
 {
-    /* Must first determine how many arguments there are.
-     * Replace all white space with null characters
-     */
-    size_t len = strlen(line);
-
-    /* First copy into buffer with each substring null-terminated */
-    char *buf = malloc_or_fail(len + 1, "parse_args");
-    buf[len] = '\0';
+    if (len + 1 > PARSE_BUFSIZE - parse_used)
+        return NULL;
 
-    char *src = line;
-    char *dst = buf;
+    /* Copy into buffer with each word null-terminated */
+    char **argv = parse_argv + parse_argc;
+    char *dst = parse_buf + parse_used;
     bool skipping = true;
     int c;
     int argc = 0;
-    while ((c = *src++) != '\0') {
+    for (const char *end = line + len; line < end;) {
+        c = *line++;
         if (isspace(c)) {
             if (!skipping) {
                 /* Hit end of word */
@@ -138,22 +231,17 @@ static char **parse_args(char *line, int *argcp)
         } else {
             if (skipping) {
                 /* Hit start of new word */
-                argc++;
+                argv[argc++] = dst;
                 skipping = false;
             }
             *dst++ = c;
         }
     }
+    if (!skipping)
+        *dst++ = '\0';
 
-    /* Now assemble into array of strings */
-    char **argv = calloc_or_fail(argc, sizeof(char *), "parse_args");
-    src = buf;
-    for (int i = 0; i < argc; i++) {
-        argv[i] = strsave_or_fail(src, "parse_args");
-        src += strlen(argv[i]) + 1;
-    }
-
-    free_block(buf, len + 1);
+    parse_used = dst - parse_buf;
+    parse_argc += argc;
     *argcp = argc;
     return argv;
 }
@@ -167,16 +255,10 @@ static void record_error()
     }
 }
 
-/* Execute a command that has already been split into arguments */
-static bool interpret_cmda(int argc, char *argv[])
+/* Execute command cmd, NULL when argv[0] names none */
+static bool run_cmd(cmd_element_t *next_cmd, int argc, char *argv[])
 {
-    if (argc == 0)
-        return true;
-    /* Try to find matching command */
-    cmd_element_t *next_cmd = cmd_list;
     bool ok = true;
-    while (next_cmd && strcmp(argv[0], next_cmd->name) != 0)
-        next_cmd = next_cmd->next;
     if (next_cmd) {
         ok = next_cmd->operation(argc, argv);
         if (!ok)
@@ -190,18 +272,279 @@ static bool interpret_cmda(int argc, char *argv[])
     return ok;
 }
 
-/* Execute a command from a command line */
-static bool interpret_cmd(char *cmdline)
+/* Execute a command that has already been split into arguments */
+static bool interpret_cmda(int argc, char *argv[])
+{
+    if (argc == 0)
+        return true;
+    /* Try to find matching command */
+    return run_cmd(find_cmd(argv[0]), argc, argv);
+}
+
+static void json_string(const char *s)
+{
+    fputc('"', json_file);
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\')
+            fprintf(json_file, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(json_file, "\\u%04x", c);
+        else
+            fputc(c, json_file);
+    }
+    fputc('"', json_file);
+}
+
+static void json_record(int argc,
+                        char *argv[],
+                        long elapsed,
+                        const alloc_stats_t *stats,
+                        bool ok)
+{
+    fputs(json_first ? "[\n" : ",\n", json_file);
+    json_first = false;
+    fputs("  {\"command\": ", json_file);
+    json_string(argv[0]);
+    fputs(", \"args\": [", json_file);
+    for (int i = 1; i < argc; i++) {
+        if (i > 1)
+            fputs(", ", json_file);
+        json_string(argv[i]);
+    }
+    fprintf(json_file,
+            "], \"queue_size\": %lu, \"elapsed_ns\": %ld, "
+            "\"allocations\": %lu, \"peak_bytes\": %lu, \"result\": %s}",
+            element_counter ? element_counter() : 0, elapsed, stats->allocs,
+            stats->peak_bytes, ok ? "true" : "false");
+    fflush(json_file);
+}
+
+/* Run a command read from input, recording it when asked to */
+static bool run_input_cmd(cmd_element_t *cmd, int argc, char *argv[])
+{
+    allocation_stats_reset();
+    if (!json_file)
+        return run_cmd(cmd, argc, argv);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    bool ok = run_cmd(cmd, argc, argv);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    alloc_stats_t stats;
+    allocation_stats(&stats);
+    json_record(argc, argv,
+                (end.tv_sec - start.tv_sec) * 1000000000L +
+                    (end.tv_nsec - start.tv_nsec),
+                &stats, ok);
+    return ok;
+}
+
+/* Lines between loop and the matching end are recorded, already split and
+ * looked up, and run once end is read.
+ */
+#define LOOP_MAX_DEPTH 16
+
+typedef struct {
+    cmd_element_t *cmd;
+    int argc;
+    char **argv; /* Along with the words, in a single block */
+    size_t size; /* Of that block */
+    int reps;    /* For a nested loop, its count */
+    int end;     /* For a nested loop, the index of its end */
+} loop_line_t;
+
+static loop_line_t *loop_lines = NULL;
+static int loop_count = 0, loop_alloc = 0;
+static int loop_reps;
+/* Open loops while recording, innermost last */
+static int loop_open[LOOP_MAX_DEPTH];
+static int loop_depth = 0;
+
+static bool do_loop(int argc, char *argv[]);
+static bool do_end(int argc, char *argv[]);
+
+static void loop_free(loop_line_t *lines, int count, int alloc)
+{
+    for (int i = 0; i < count; i++)
+        free_block(lines[i].argv, lines[i].size);
+    if (lines)
+        free_array(lines, alloc, sizeof(loop_line_t));
+}
+
+static void loop_discard()
+{
+    loop_free(loop_lines, loop_count, loop_alloc);
+    loop_lines = NULL;
+    loop_count = loop_alloc = 0;
+    loop_depth = 0;
+}
+
+static bool get_loop_count(int argc, char *argv[], int *reps)
+{
+    if (argc != 2 || !get_int(argv[1], reps) || *reps < 0) {
+        report(1, "%s needs a count", argv[0]);
+        return false;
+    }
+    return true;
+}
+
+/* Record a line into the loop being read */
+static void loop_add(cmd_element_t *cmd, int argc, char *argv[])
+{
+    if (loop_count == loop_alloc) {
+        int alloc = loop_alloc ? 2 * loop_alloc : 16;
+        loop_line_t *lines =
+            malloc_or_fail(alloc * sizeof(loop_line_t), "loop_add");
+        if (loop_lines) {
+            memcpy(lines, loop_lines, loop_count * sizeof(loop_line_t));
+            free_array(loop_lines, loop_alloc, sizeof(loop_line_t));
+        }
+        loop_lines = lines;
+        loop_alloc = alloc;
+    }
+
+    size_t size = argc * sizeof(char *);
+    for (int i = 0; i < argc; i++)
+        size += strlen(argv[i]) + 1;
+    loop_line_t *line = &loop_lines[loop_count++];
+    line->cmd = cmd;
+    line->argc = argc;
+    line->argv = malloc_or_fail(size, "loop_add");
+    line->size = size;
+    line->reps = 0;
+    line->end = 0;
+    char *dst = (char *) (line->argv + argc);
+    for (int i = 0; i < argc; i++) {
+        line->argv[i] = dst;
+        dst = stpcpy(dst, argv[i]) + 1;
+    }
+}
+
+/* Run lines [from, to) reps times, stopping at the first failure.
+ * Files sourced by a line are run before the next line.
+ */
+static bool loop_run(loop_line_t *lines, int from, int to, int reps)
+{
+    rio_t *outer = buf_stack;
+    bool ok = true;
+    for (int r = 0; ok && r < reps && !quit_flag; r++) {
+        for (int i = from; ok && i < to && !quit_flag; i++) {
+            loop_line_t *line = &lines[i];
+            if (line->end) {
+                ok = loop_run(lines, i + 1, line->end, line->reps);
+                i = line->end;
+            } else {
+                ok = run_input_cmd(line->cmd, line->argc, line->argv);
+                run_sources(outer);
+            }
+        }
+    }
+    return ok;
+}
+
+/* Record a line while reading a loop, running the loop once it ends */
+static bool loop_record(cmd_element_t *cmd, int argc, char *argv[])
+{
+    bool is_loop = cmd && cmd->operation == do_loop;
+    bool is_end = cmd && cmd->operation == do_end;
+
+    if (is_end && loop_depth == 1) {
+        /* Take the lines over, sourced files may record loops of their own */
+        loop_line_t *lines = loop_lines;
+        int count = loop_count, alloc = loop_alloc;
+        loop_lines = NULL;
+        loop_count = loop_alloc = loop_depth = 0;
+        bool ok = loop_run(lines, 0, count, loop_reps);
+        loop_free(lines, count, alloc);
+        return ok;
+    }
+
+    if (is_loop) {
+        int reps;
+        if (!get_loop_count(argc, argv, &reps)) {
+            loop_discard();
+            record_error();
+            return false;
+        }
+        if (loop_depth == LOOP_MAX_DEPTH) {
+            report(1, "Loops nested too deep");
+            loop_discard();
+            record_error();
+            return false;
+        }
+        loop_open[loop_depth++] = loop_count;
+        loop_add(cmd, argc, argv);
+        loop_lines[loop_count - 1].reps = reps;
+    } else {
+        loop_add(cmd, argc, argv);
+        if (is_end)
+            loop_lines[loop_open[--loop_depth]].end = loop_count - 1;
+    }
+    return true;
+}
+
+/* Run a command read from input, or record it into the loop being read */
+static bool run_line(cmd_element_t *cmd, int argc, char *argv[])
+{
+    if (loop_depth)
+        return loop_record(cmd, argc, argv);
+
+    return run_input_cmd(cmd, argc, argv);
+}
+
+static bool do_loop(int argc, char *argv[])
+{
+    if (!get_loop_count(argc, argv, &loop_reps))
+        return false;
+    loop_depth = 1;
+    return true;
+}
+
+static bool do_end(int argc, char *argv[])
+{
+    report(1, "%s without loop", argv[0]);
+    return false;
+}
+
+static bool do_repeat(int argc, char *argv[])
+{
+    int reps;
+    if (argc < 3 || !get_int(argv[1], &reps) || reps < 0) {
+        report(1, "%s needs a count and a command", argv[0]);
+        return false;
+    }
+
+    /* Look the command up once, stopping at the first failure */
+    cmd_element_t *cmd = find_cmd(argv[2]);
+    rio_t *outer = buf_stack;
+    bool ok = true;
+    for (int i = 0; ok && i < reps && !quit_flag; i++) {
+        ok = run_cmd(cmd, argc - 2, argv + 2);
+        run_sources(outer);
+    }
+    return ok;
+}
+
+/* Execute a command from a command line of len bytes */
+static bool interpret_cmd(const char *cmdline, size_t len)
 {
     if (quit_flag)
         return false;
 
+    size_t saved_used = parse_used;
+    int saved_argc = parse_argc;
     int argc;
-    char **argv = parse_args(cmdline, &argc);
-    bool ok = interpret_cmda(argc, argv);
-    for (int i = 0; i < argc; i++)
-        free_string(argv[i]);
-    free_array(argv, argc, sizeof(char *));
+    char **argv = parse_args(cmdline, len, &argc);
+    if (!argv) {
+        report(1, "Command line too long");
+        record_error();
+        return false;
+    }
+
+    bool ok = argc == 0 || run_line(find_cmd(argv[0]), argc, argv);
+    parse_used = saved_used;
+    parse_argc = saved_argc;
 
     return ok;
 }
@@ -215,6 +558,18 @@ void add_quit_helper(cmd_func_t qf)
         report_event(MSG_FATAL, "Exceeded limit on quit helpers");
 }
 
+void set_element_counter(count_func_t counter)
+{
+    element_counter = counter;
+}
+
+bool set_json_file(const char *file_name)
+{
+    json_file = fopen(file_name, "w");
+    json_first = true;
+    return json_file != NULL;
+}
+
 /* Turn echoing on/off */
 void set_echo(bool on)
 {
@@ -238,10 +593,21 @@ static bool do_quit(int argc, char *argv[])
         p = p->next;
         free_block(ele, sizeof(param_element_t));
     }
+    cmd_list = NULL;
+    param_list = NULL;
+    memset(cmd_table, 0, sizeof(cmd_table));
+    memset(param_table, 0, sizeof(param_table));
+    cmd_count = param_count = 0;
 
     while (buf_stack)
         pop_file();
 
+    if (loop_depth) {
+        report(1, "Missing end of loop");
+        loop_discard();
+        ok = false;
+    }
+
     for (int i = 0; i < quit_helper_cnt; i++) {
         ok = ok && quit_helpers[i](argc, argv);
     }
@@ -311,7 +677,6 @@ static bool do_option(int argc, char *argv[])
     for (int i = 1; i < argc; i++) {
         char *name = argv[i];
         int value = 0;
-        bool found = false;
         /* Get value from next argument */
         if (i + 1 >= argc) {
             report(1, "No value given for parameter %s", name);
@@ -320,23 +685,16 @@ static bool do_option(int argc, char *argv[])
             report(1, "Cannot parse '%s' as integer", argv[i]);
             return false;
         }
-        /* Find parameter in list */
-        param_element_t *plist = param_list;
-        while (!found && plist) {
-            if (strcmp(plist->name, name) == 0) {
-                int oldval = *plist->valp;
-                *plist->valp = value;
-                if (plist->setter)
-                    plist->setter(oldval);
-                found = true;
-            } else
-                plist = plist->next;
-        }
-        /* Didn't find parameter */
-        if (!found) {
+        /* Find parameter in table */
+        param_element_t *param = find_param(name);
+        if (!param) {
             report(1, "Unknown parameter '%s'", name);
             return false;
         }
+        int oldval = *param->valp;
+        *param->valp = value;
+        if (param->setter)
+            param->setter(oldval);
     }
 
     return true;
@@ -349,6 +707,9 @@ static bool do_source(int argc, char *argv[])
         return false;
     }
 
+    if (is_compiled_trace(argv[1]))
+        return run_compiled_trace(argv[1]);
+
     if (!push_file(argv[1])) {
         report(1, "Could not open source file '%s'", argv[1]);
         return false;
@@ -371,8 +732,90 @@ static bool do_log(int argc, char *argv[])
     return result;
 }
 
+/* Show how many allocations of each size class the timed command made */
+static void report_size_classes(const alloc_stats_t *stats)
+{
+    for (int k = 0; k < ALLOC_SIZE_CLASSES; k++) {
+        if (!stats->size_classes[k])
+            continue;
+        size_t low = k ? (size_t) 1 << (k - 1) : 0;
+        size_t high = k ? ((size_t) 1 << k) - 1 : 0;
+        if (k == ALLOC_SIZE_CLASSES - 1)
+            report(2, "  %10lu+ bytes: %lu", low, stats->size_classes[k]);
+        else
+            report(2, "  %10lu-%lu bytes: %lu", low, high,
+                   stats->size_classes[k]);
+    }
+}
+
+static int cmp_long(const void *a, const void *b)
+{
+    long x = *(const long *) a, y = *(const long *) b;
+    return (x > y) - (x < y);
+}
+
+/* Elements a command operated on, given counts taken before and after it:
+ * those it added or removed, or else those it found
+ */
+static size_t elements_between(size_t before, size_t after)
+{
+    if (after > before)
+        return after - before;
+    if (after < before)
+        return before - after;
+    return after;
+}
+
+/* Run a command runs times, stopping at the first failure, and report the
+ * distribution of the times taken
+ */
+static bool time_runs(int runs, int argc, char *argv[])
+{
+    long *samples = calloc_or_fail(runs, sizeof(long), "time_runs");
+    cmd_element_t *cmd = find_cmd(argv[0]);
+    size_t elements = 0;
+    long total = 0;
+    bool ok = true;
+    int done;
+    for (done = 0; ok && done < runs && !quit_flag; done++) {
+        size_t before = element_counter ? element_counter() : 0;
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        ok = run_cmd(cmd, argc, argv);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        samples[done] = (end.tv_sec - start.tv_sec) * 1000000000L +
+                        (end.tv_nsec - start.tv_nsec);
+        total += samples[done];
+
+        size_t after = element_counter ? element_counter() : 0;
+        elements += elements_between(before, after);
+    }
+
+    if (done) {
+        qsort(samples, done, sizeof(long), cmp_long);
+        report(1,
+               "Runs = %d, min = %ld ns, median = %ld ns, p99 = %ld ns, "
+               "max = %ld ns",
+               done, samples[0], samples[(done - 1) / 2],
+               samples[(99 * done + 99) / 100 - 1], samples[done - 1]);
+        if (elements)
+            report(1, "Time per element = %.1f ns", (double) total / elements);
+    }
+    free_array(samples, runs, sizeof(long));
+    return ok;
+}
+
 static bool do_time(int argc, char *argv[])
 {
+    if (argc > 1 && !strcmp(argv[1], "-n")) {
+        int runs;
+        if (argc <= 3 || !get_int(argv[2], &runs) || runs <= 0) {
+            report(1, "%s -n needs a number of runs and a command", argv[0]);
+            return false;
+        }
+        return time_runs(runs, argc - 3, argv + 3);
+    }
+
     double delta = delta_time(&last_time);
     bool ok = true;
     if (argc <= 1) {
@@ -384,13 +827,160 @@ static bool do_time(int argc, char *argv[])
             block_timing = true;
         } else {
             delta = delta_time(&last_time);
-            report(1, "Delta time = %.3f", delta);
+            alloc_stats_t stats;
+            allocation_stats(&stats);
+            report(1, "Delta time = %.3f, Peak memory = %lu bytes, "
+                      "Allocations = %lu",
+                   delta, stats.peak_bytes, stats.allocs);
+            report_size_classes(&stats);
         }
     }
 
     return ok;
 }
 
+#if defined(__linux__)
+static const struct {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+} perf_events[] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"cache misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {"branch misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {"page faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+};
+#define PERF_EVENTS (sizeof(perf_events) / sizeof(perf_events[0]))
+
+/* Open a counter of this process in user space, disabled, or return -1 */
+static int perf_open(uint32_t type, uint64_t config)
+{
+    struct perf_event_attr attr = {
+        .size = sizeof(attr),
+        .type = type,
+        .config = config,
+        .disabled = 1,
+        .exclude_kernel = 1,
+        .exclude_hv = 1,
+        .read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+                       PERF_FORMAT_TOTAL_TIME_RUNNING,
+    };
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/* Read a counter, scaled up for the time it was multiplexed out */
+static bool perf_read(int fd, double *value)
+{
+    uint64_t data[3]; /* Value, time enabled, time running */
+    if (read(fd, data, sizeof(data)) != sizeof(data) || !data[2])
+        return false;
+    *value = (double) data[0] * data[1] / data[2];
+    return true;
+}
+#endif
+
+/* Run a command under hardware and software performance counters.
+ * Counters are opened one at a time, so that those the kernel refuses, as it
+ * may in containers or with a high perf_event_paranoid, are left out on their
+ * own. The command runs even if none can be opened.
+ */
+static bool do_perf(int argc, char *argv[])
+{
+    if (argc <= 1) {
+        report(1, "%s needs a command", argv[0]);
+        return false;
+    }
+
+#if defined(__linux__)
+    int fds[PERF_EVENTS];
+    int opened = 0;
+    for (size_t i = 0; i < PERF_EVENTS; i++) {
+        fds[i] = perf_open(perf_events[i].type, perf_events[i].config);
+        if (fds[i] >= 0)
+            opened++;
+    }
+    if (!opened)
+        report(1, "Performance counters are not available, running without");
+
+    size_t before = element_counter ? element_counter() : 0;
+    for (size_t i = 0; i < PERF_EVENTS; i++) {
+        if (fds[i] >= 0)
+            ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+    bool ok = interpret_cmda(argc - 1, argv + 1);
+    for (size_t i = 0; i < PERF_EVENTS; i++) {
+        if (fds[i] >= 0)
+            ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+    }
+    size_t elements = elements_between(
+        before, element_counter ? element_counter() : 0);
+
+    double values[PERF_EVENTS];
+    bool valid[PERF_EVENTS];
+    if (opened)
+        report(1, "Performance counters:");
+    for (size_t i = 0; i < PERF_EVENTS; i++) {
+        valid[i] = fds[i] >= 0 && perf_read(fds[i], &values[i]);
+        if (fds[i] >= 0)
+            close(fds[i]);
+        if (!opened)
+            continue;
+        if (!valid[i])
+            report(1, "  %-14s %16s", perf_events[i].name,
+                   fds[i] < 0 ? "not available" : "not counted");
+        else if (elements)
+            report(1, "  %-14s %16.0f  %10.2f per element",
+                   perf_events[i].name, values[i], values[i] / elements);
+        else
+            report(1, "  %-14s %16.0f", perf_events[i].name, values[i]);
+    }
+    /* Cycles and instructions come first */
+    if (valid[0] && valid[1] && values[0] > 0)
+        report(1, "  IPC = %.2f", values[1] / values[0]);
+    return ok;
+#else
+    report(1, "Performance counters are only supported on Linux");
+    return interpret_cmda(argc - 1, argv + 1);
+#endif
+}
+
+/* Run a command with a time budget of its own for the operations it times */
+static bool do_budget(int argc, char *argv[])
+{
+    if (argc <= 2) {
+        report(1, "%s needs a budget in microseconds and a command", argv[0]);
+        return false;
+    }
+
+    int budget;
+    if (!get_int(argv[1], &budget) || budget < 0) {
+        report(1, "Invalid time budget '%s'", argv[1]);
+        return false;
+    }
+
+    int saved_budget = time_budget;
+    size_t ops = timed_ops();
+    time_budget = budget;
+    bool ok = interpret_cmda(argc - 2, argv + 2);
+    time_budget = saved_budget;
+
+    /* Commands that timed nothing leave an earlier time behind */
+    if (timed_ops() == ops) {
+        report(1, "No operation was timed");
+        return ok;
+    }
+
+    long spent = last_op_time();
+    if (!budget)
+        report(1, "Took %ld us of unlimited budget", spent);
+    else if (spent >= budget)
+        report(1, "Time budget of %d us exceeded after %ld us", budget, spent);
+    else
+        report(1, "Took %ld us of %d us budget", spent, budget);
+    return ok;
+}
+
 static bool use_linenoise = true;
 static int web_fd;
 
@@ -429,7 +1019,15 @@ void init_cmd()
     ADD_COMMAND(quit, "Exit program", "");
     ADD_COMMAND(source, "Read commands from source file", "");
     ADD_COMMAND(log, "Copy output to file", "file");
-    ADD_COMMAND(time, "Time command execution", "cmd arg ...");
+    ADD_COMMAND(time, "Time command execution, N times with -n",
+                "[-n N] cmd arg ...");
+    ADD_COMMAND(repeat, "Run command N times, until it fails", "N cmd arg ...");
+    ADD_COMMAND(loop, "Run the commands up to the matching end N times", "N");
+    ADD_COMMAND(end, "End the commands run by loop", "");
+    ADD_COMMAND(perf, "Count cycles, cache misses and more of command",
+                "cmd arg ...");
+    ADD_COMMAND(budget, "Hold command to time budget, in microseconds",
+                "usec cmd arg ...");
     ADD_COMMAND(web, "Read commands from builtin web server", "[port]");
     add_cmd("#", do_comment_cmd, "Display comment", "...");
     add_param("simulation", &simulation, "Start/Stop simulation mode", NULL);
@@ -461,7 +1059,20 @@ static bool push_file(char *fname)
     rnew->fd = fd;
     rnew->count = 0;
     rnew->bufptr = rnew->buf;
+    rnew->map = NULL;
+    rnew->map_size = 0;
     rnew->prev = buf_stack;
+
+    /* Pipes, terminals and empty files are read through the buffer */
+    struct stat st;
+    if (fname && !fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0) {
+        char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            rnew->map = rnew->bufptr = map;
+            rnew->map_size = rnew->count = st.st_size;
+        }
+    }
     buf_stack = rnew;
 
     return true;
@@ -473,6 +1084,8 @@ static void pop_file()
     if (buf_stack) {
         rio_t *rsave = buf_stack;
         buf_stack = rsave->prev;
+        if (rsave->map)
+            munmap(rsave->map, rsave->map_size);
         close(rsave->fd);
         free_block(rsave, sizeof(rio_t));
     }
@@ -484,60 +1097,65 @@ static void init_in()
     buf_stack = NULL;
 }
 
-/* Read command from input file.
+/* Read command from input file, storing its length, newline excluded, in
+ * lenp.
+ * Lines are returned where they lie in the mapping or the buffer, and only
+ * move to the front of the buffer when they straddle a refill.
  * When hit EOF, close that file and return NULL
  */
-static char *readline()
+static char *readline(size_t *lenp)
 {
-    char c;
-    char *lptr = linebuf;
-
     if (!buf_stack)
         return NULL;
 
-    for (int cnt = 0; cnt < RIO_BUFSIZE - 2; cnt++) {
-        if (buf_stack->count <= 0) {
-            /* Need to read from input file */
-            buf_stack->count = read(buf_stack->fd, buf_stack->buf, RIO_BUFSIZE);
-            buf_stack->bufptr = buf_stack->buf;
-            if (buf_stack->count <= 0) {
-                /* Encountered EOF */
-                pop_file();
-                if (cnt > 0) {
-                    /* Last line of file did not terminate with newline. */
-                    /*  Terminate line & return it */
-                    *lptr++ = '\n';
-                    *lptr++ = '\0';
-                    if (echo) {
-                        report_noreturn(1, prompt);
-                        report_noreturn(1, linebuf);
-                    }
-                    return linebuf;
-                }
+    rio_t *rio = buf_stack;
+    char *line = rio->bufptr;
+    char *end = memchr(line, '\n', rio->count);
+    while (!end && !rio->map && rio->count < RIO_BUFSIZE) {
+        /* Need to read from input file */
+        memmove(rio->buf, line, rio->count);
+        line = rio->bufptr = rio->buf;
+        ssize_t cnt =
+            read(rio->fd, rio->buf + rio->count, RIO_BUFSIZE - rio->count);
+        if (cnt <= 0) {
+            /* Encountered EOF */
+            *lenp = rio->count;
+            memcpy(linebuf, line, *lenp);
+            pop_file();
+            if (*lenp == 0)
                 return NULL;
-            }
+            /* Last line of file did not terminate with newline. */
+            line = linebuf;
+            goto done;
         }
-
-        /* Have text in buffer */
-        c = *buf_stack->bufptr++;
-        *lptr++ = c;
-        buf_stack->count--;
-        if (c == '\n')
-            break;
+        end = memchr(rio->buf + rio->count, '\n', cnt);
+        rio->count += cnt;
     }
 
-    if (c != '\n') {
-        /* Hit buffer limit.  Artificially terminate line */
-        *lptr++ = '\n';
+    if (end) {
+        rio->count -= end + 1 - line;
+        rio->bufptr = end + 1;
+    } else if (rio->count) {
+        /* Take the rest of the mapping, or artificially terminate line at
+         * buffer limit
+         */
+        end = line + rio->count;
+        rio->count = 0;
+        rio->bufptr = end;
+    } else {
+        /* Encountered end of mapping */
+        pop_file();
+        return NULL;
     }
-    *lptr++ = '\0';
+    *lenp = end - line;
 
+done:
     if (echo) {
         report_noreturn(1, prompt);
-        report_noreturn(1, linebuf);
+        report(1, "%.*s", (int) *lenp, line);
     }
 
-    return linebuf;
+    return line;
 }
 
 static bool cmd_done()
@@ -584,24 +1202,260 @@ static int cmd_select(int nfds,
         if (infd == STDIN_FILENO && prompt_flag) {
             char *cmdline = linenoise(prompt);
             if (cmdline)
-                interpret_cmd(cmdline);
+                interpret_cmd(cmdline, strlen(cmdline));
             fflush(stdout);
             prompt_flag = true;
         } else if (infd != STDIN_FILENO) {
-            char *cmdline = readline();
+            size_t len;
+            char *cmdline = readline(&len);
             if (cmdline)
-                interpret_cmd(cmdline);
+                interpret_cmd(cmdline, len);
         }
     }
     return 0;
 }
 
+/* Run files pushed on top of outer by source, before anything that follows */
+static void run_sources(rio_t *outer)
+{
+    while (buf_stack != outer && !quit_flag)
+        cmd_select(0, NULL, NULL, NULL, NULL);
+}
+
+/* Compiled traces.
+ * A trace compiles to a header, one record per command line, and the table
+ * of the command names it uses, which the header gives the offset of. A
+ * record holds the index of its command name and its number of arguments,
+ * followed by each argument, preceded by its length and null-terminated.
+ * Record fields are unsigned LEB128 numbers, seven bits to a byte, and header
+ * fields are in host byte order.
+ */
+static const char trace_magic[8] = "QTRACE\0\1";
+
+typedef struct {
+    char magic[8];
+    uint32_t names;   /* Number of command names */
+    uint32_t records; /* Number of command lines */
+    uint64_t names_offset;
+} trace_header_t;
+
+static bool is_compiled_trace(char *fname)
+{
+    char magic[sizeof(trace_magic)];
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0)
+        return false;
+    bool found = read(fd, magic, sizeof(magic)) == sizeof(magic) &&
+                 !memcmp(magic, trace_magic, sizeof(magic));
+    close(fd);
+    return found;
+}
+
+static bool put_number(FILE *file, uint32_t v)
+{
+    for (; v >= 0x80; v >>= 7) {
+        if (putc(v | 0x80, file) == EOF)
+            return false;
+    }
+    return putc(v, file) != EOF;
+}
+
+/* Read a number at *pos, not past end */
+static bool get_number(char **pos, char *end, uint32_t *v)
+{
+    *v = 0;
+    for (int shift = 0; *pos < end && shift < 32; shift += 7) {
+        unsigned char c = *(*pos)++;
+        *v |= (uint32_t) (c & 0x7f) << shift;
+        if (!(c & 0x80))
+            return true;
+    }
+    return false;
+}
+
+bool compile_trace(char *infile_name, char *outfile_name)
+{
+    if (!push_file(infile_name)) {
+        report(1, "ERROR: Could not open source file '%s'", infile_name);
+        return false;
+    }
+    FILE *out = fopen(outfile_name, "wb");
+    if (!out) {
+        report(1, "ERROR: Could not create '%s'", outfile_name);
+        while (buf_stack)
+            pop_file();
+        return false;
+    }
+
+    trace_header_t header = {.names = 0, .records = 0};
+    memcpy(header.magic, trace_magic, sizeof(trace_magic));
+    bool ok = fwrite(&header, sizeof(header), 1, out) == 1;
+
+    char *names[NAME_TABLE_SIZE];
+    size_t saved_used = parse_used;
+    int saved_argc = parse_argc;
+    size_t len;
+    char *line;
+    while (ok && (line = readline(&len))) {
+        int argc;
+        char **argv = parse_args(line, len, &argc);
+        if (!argv) {
+            report(1, "ERROR: Command line too long");
+            ok = false;
+            break;
+        }
+        parse_used = saved_used;
+        parse_argc = saved_argc;
+        if (argc == 0)
+            continue;
+
+        /* Names are few, a linear search will do */
+        uint32_t op = 0;
+        while (op < header.names && strcmp(names[op], argv[0]))
+            op++;
+        if (op == header.names) {
+            if (header.names == NAME_TABLE_SIZE) {
+                report(1, "ERROR: Too many distinct commands");
+                ok = false;
+                break;
+            }
+            names[header.names++] = strsave_or_fail(argv[0], "compile_trace");
+        }
+
+        ok = put_number(out, op) && put_number(out, argc - 1);
+        for (int i = 1; ok && i < argc; i++) {
+            uint32_t arg_len = strlen(argv[i]);
+            ok = put_number(out, arg_len) &&
+                 fwrite(argv[i], 1, arg_len + 1, out) == arg_len + 1;
+        }
+        header.records++;
+    }
+    while (buf_stack)
+        pop_file();
+
+    header.names_offset = ok ? ftell(out) : 0;
+    for (uint32_t i = 0; i < header.names; i++) {
+        ok = ok && fwrite(names[i], 1, strlen(names[i]) + 1, out) ==
+                       strlen(names[i]) + 1;
+        free_string(names[i]);
+    }
+    ok = ok && !fseek(out, 0, SEEK_SET) &&
+         fwrite(&header, sizeof(header), 1, out) == 1;
+    if (fclose(out) || !ok) {
+        report(1, "ERROR: Could not write '%s'", outfile_name);
+        return false;
+    }
+
+    return true;
+}
+
+/* Run the commands of a compiled trace, each of them along with any file it
+ * sources, and return false if the trace is damaged
+ */
+static bool replay_trace(char *data, size_t size)
+{
+    trace_header_t header;
+    memcpy(&header, data, sizeof(header));
+    if (header.names_offset < sizeof(header) || header.names_offset > size ||
+        header.names > NAME_TABLE_SIZE)
+        return false;
+
+    /* Look commands up once and for all */
+    char *names[NAME_TABLE_SIZE];
+    cmd_element_t *cmds[NAME_TABLE_SIZE];
+    char *pos = data + header.names_offset;
+    char *end = data + size;
+    for (uint32_t i = 0; i < header.names; i++) {
+        char *name_end = memchr(pos, '\0', end - pos);
+        if (!name_end)
+            return false;
+        names[i] = pos;
+        cmds[i] = find_cmd(pos);
+        pos = name_end + 1;
+    }
+
+    /* Arguments are used where they lie in the trace, yet every one of them
+     * reserves its two bytes of parse_buf, as if it had been parsed there
+     */
+    char **argv = parse_argv + parse_argc;
+    size_t max_argc = (PARSE_BUFSIZE - parse_used) / 2;
+    rio_t *outer = buf_stack;
+    pos = data + sizeof(header);
+    end = data + header.names_offset;
+    for (uint32_t r = 0; r < header.records && !quit_flag; r++) {
+        uint32_t op, argc;
+        if (!get_number(&pos, end, &op) || op >= header.names ||
+            !get_number(&pos, end, &argc) || argc >= max_argc)
+            return false;
+        argv[0] = names[op];
+        for (uint32_t i = 1; i <= argc; i++) {
+            uint32_t len;
+            if (!get_number(&pos, end, &len) || len >= end - pos || pos[len])
+                return false;
+            argv[i] = pos;
+            pos += len + 1;
+        }
+
+        if (echo) {
+            report_noreturn(1, prompt);
+            for (uint32_t i = 0; i < argc; i++)
+                report_noreturn(1, "%s ", argv[i]);
+            report(1, "%s", argv[argc]);
+        }
+        parse_used += 2 * (argc + 1);
+        parse_argc += argc + 1;
+        run_line(cmds[op], argc + 1, argv);
+        parse_used -= 2 * (argc + 1);
+        parse_argc -= argc + 1;
+        run_sources(outer);
+    }
+
+    return true;
+}
+
+static bool run_compiled_trace(char *fname)
+{
+    int fd = open(fname, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st)) {
+        report(1, "ERROR: Could not open compiled trace '%s'", fname);
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+
+    /* Private and writable, should a command modify its arguments */
+    char *data = MAP_FAILED;
+    if (st.st_size >= sizeof(trace_header_t))
+        data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd,
+                    0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        report(1, "ERROR: Could not map compiled trace '%s'", fname);
+        return false;
+    }
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+    bool ok = replay_trace(data, st.st_size);
+    if (!ok) {
+        report(1, "ERROR: Compiled trace '%s' is damaged", fname);
+        record_error();
+    }
+    munmap(data, st.st_size);
+    return ok;
+}
+
 bool finish_cmd()
 {
     bool ok = true;
     if (!quit_flag)
         ok = ok && do_quit(0, NULL);
     has_infile = false;
+    if (json_file) {
+        fputs(json_first ? "[]\n" : "\n]\n", json_file);
+        fclose(json_file);
+        json_file = NULL;
+    }
     return ok && err_cnt == 0;
 }
 
@@ -648,6 +1502,9 @@ void completion(const char *buf, line_completions_t *lc)
 
 bool run_console(char *infile_name)
 {
+    if (infile_name && is_compiled_trace(infile_name))
+        return run_compiled_trace(infile_name) && err_cnt == 0;
+
     if (!push_file(infile_name)) {
         report(1, "ERROR: Could not open source file '%s'", infile_name);
         return false;
@@ -656,7 +1513,7 @@ bool run_console(char *infile_name)
     if (!has_infile) {
         char *cmdline;
         while (use_linenoise && (cmdline = linenoise(prompt))) {
-            interpret_cmd(cmdline);
+            interpret_cmd(cmdline, strlen(cmdline));
             line_history_add(cmdline);       /* Add to the history. */
             line_history_save(HISTORY_FILE); /* Save the history on disk. */
             line_free(cmdline);
@@ -18,7 +18,9 @@ typedef bool (*cmd_func_t)(int argc, char *argv[]);
 
 /* Information about each command */
 
-/* Organized as linked list in alphabetical order */
+/* Organized as linked list in alphabetical order, and found by name through a
+ * hash table
+ */
 typedef struct __cmd_element {
     char *name;
     cmd_func_t operation;
@@ -56,6 +58,18 @@ bool get_int(char *vname, int *loc);
 /* Add function to be executed as part of program exit */
 void add_quit_helper(cmd_func_t qf);
 
+/* Optionally supply function counting the elements commands operate on, for
+ * time -n to report time per element
+ */
+typedef size_t (*count_func_t)(void);
+void set_element_counter(count_func_t counter);
+
+/* Write a JSON record of every command read from input to file_name: its
+ * words, the number of elements once it ran, its time, allocations and
+ * result. Return true if successful.
+ */
+bool set_json_file(const char *file_name);
+
 /* Turn echoing on/off */
 void set_echo(bool on);
 
@@ -64,6 +78,12 @@ void set_echo(bool on);
 /* Return true if no errors occurred */
 bool finish_cmd();
 
+/* Compile the commands read from infile_name into outfile_name, to be run by
+ * run_console or the source command without parsing them again.
+ * Return true if successful.
+ */
+bool compile_trace(char *infile_name, char *outfile_name);
+
 /* Run command loop.  Non-null infile_name implies read commands from that file
  */
 bool run_console(char *infile_name);
@@ -1,11 +1,18 @@
 /* Test support code */
 
+#define _GNU_SOURCE /* gettid, SIGEV_THREAD_ID */
+
+#include <pthread.h>
 #include <setjmp.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "report.h"
@@ -25,39 +32,218 @@
 /* Value at end of every block */
 #define MAGICFOOTER 0xbeefdead
 
+/* Value at start of every block carved from an arena */
+#define MAGICARENA 0xdeadbabe
+
+/* Value at start of every block allocated in fast mode */
+#define MAGICFAST 0xdeadfa57
+
+/* Value at start of every block followed by a guard page */
+#define MAGICGUARD 0xdeadf00d
+
 /* Byte to fill newly malloced space with */
 #define FILLCHAR 0x55
 
 /* Data structures used by our code */
 
-/* Represent allocated blocks as doubly-linked list, with
- * next and prev pointers at beginning
+/* Statistics of one call site, kept while profiling allocations */
+typedef struct {
+    void *_Atomic site;
+    atomic_size_t allocs, bytes;
+    atomic_size_t live_blocks, live_bytes;
+} site_record_t;
+
+/* Header placed in front of every allocated block.
+ * Blocks carved from an arena point back to the arena, NULL otherwise.
+ * Blocks allocated while profiling point to the record of their call site,
+ * unless they belong to an arena, as those are not freed one at a time.
  */
 typedef struct __block_element {
-    struct __block_element *next, *prev;
+    arena_t *arena;
+    site_record_t *site;
     size_t payload_size;
-    size_t magic_header; /* Marker to see if block seems legitimate */
+    uint32_t fast_slot;    /* Index in the fast registry, of fast blocks */
+    uint32_t magic_header; /* Marker to see if block seems legitimate */
     unsigned char payload[0];
     /* Also place magic number at tail of every block */
 } block_element_t;
 
-static block_element_t *allocated = NULL;
-static size_t allocated_count = 0;
+/* Blocks obtained from malloc are registered in an open-addressing hash set
+ * keyed by their address, using linear probing. This keeps validating a block
+ * in cautious mode O(1) no matter how many blocks are allocated.
+ * The set is split into shards, each with its own lock, so that threads
+ * allocating concurrently seldom contend. Locks are only held for a lookup,
+ * hence a spinlock, cheaper than a mutex when uncontended.
+ */
+#define REGISTRY_MIN_SIZE 64
+#define REGISTRY_SHARD_BITS 4
+#define REGISTRY_SHARDS (1 << REGISTRY_SHARD_BITS)
+
+typedef struct {
+    atomic_flag lock;
+    block_element_t **slots;
+    size_t size;  /* Number of slots, a power of 2 */
+    size_t count; /* Number of blocks in the shard */
+} registry_t;
+
+static registry_t registry[REGISTRY_SHARDS] = {
+    [0 ... REGISTRY_SHARDS - 1] = {.lock = ATOMIC_FLAG_INIT},
+};
+
+/* Blocks allocated in fast mode are registered in a compact table instead.
+ * Every such block keeps the index of its slot, which points back to it, so
+ * registering and checking a block takes a single access, without hashing or
+ * probing. Slots of freed blocks are chained, last freed first, through their
+ * index shifted left and tagged with bit 0, which block addresses never have.
+ */
+#define FAST_SLOT_NONE UINT32_MAX
+
+static struct {
+    atomic_flag lock;
+    uintptr_t *slots;
+    uint32_t size, used; /* Slots allocated, slots ever handed out */
+    uint32_t free;       /* Most recently freed slot */
+} fast_registry = {
+    .lock = ATOMIC_FLAG_INIT,
+    .free = FAST_SLOT_NONE,
+};
+
+/* Blocks in use, heap and arena ones alike, summed over all threads */
+static atomic_size_t allocated_count = 0;
+
+/* Bytes in use, highest number of them since the statistics were reset, and
+ * allocations made since then by log2 size class
+ */
+static atomic_size_t live_bytes = 0, peak_bytes = 0;
+static atomic_size_t size_classes[ALLOC_SIZE_CLASSES];
+
+/* Arenas hand out blocks from large chunks obtained with malloc, aligned to
+ * ARENA_CHUNK_SIZE and spanning a multiple of it
+ */
+#define ARENA_CHUNK_SHIFT 20
+#define ARENA_CHUNK_SIZE (1 << ARENA_CHUNK_SHIFT)
+
+/* Blocks freed one at a time are kept for reuse on lists by size, in steps of
+ * 16 bytes. Larger blocks stay unused until the arena is released.
+ */
+#define ARENA_FREE_CLASSES 32
+
+typedef struct __arena_chunk {
+    struct __arena_chunk *next;
+    size_t used, size;
+    unsigned char data[0];
+} arena_chunk_t;
+
+/* Every ARENA_CHUNK_SIZE unit of address space covered by a chunk is entered
+ * in a hash table, so that the chunk holding a block is found from the block
+ * address alone, without reading memory that may no longer be mapped. Units
+ * of released chunks stay in the table until the heap hands out a block there
+ * again, so that freeing a block of a released arena can still be reported.
+ */
+#define CHUNK_TABLE_MIN_SIZE 64
+
+typedef struct {
+    uintptr_t unit;       /* Address >> ARENA_CHUNK_SHIFT, 0 if unused */
+    arena_chunk_t *chunk; /* NULL once the chunk is released */
+    bool released;
+} chunk_slot_t;
+
+static struct {
+    atomic_flag lock;
+    chunk_slot_t *slots;
+    size_t size, count;     /* Slots allocated, slots in use */
+    atomic_size_t units;    /* Units of live chunks */
+    atomic_size_t released; /* Units of released chunks */
+} chunk_table = {
+    .lock = ATOMIC_FLAG_INIT,
+};
+
+struct __arena {
+    arena_chunk_t *chunks;
+    atomic_size_t live_count; /* Blocks carved from the arena not yet freed */
+    atomic_size_t live_bytes; /* Payload bytes of these blocks */
+    /* Freed blocks, linked through their payload */
+    block_element_t *free_blocks[ARENA_FREE_CLASSES];
+    /* An arena merged into another one stays around, forwarding to @parent,
+     * since its blocks still point to it. @merged lists such arenas, linked
+     * through @merged_next, to be released along with the parent.
+     */
+    struct __arena *parent;
+    struct __arena *merged, *merged_next;
+};
+
+/* Blocks still in use when their arena was released, summed over arenas */
+static atomic_size_t arena_bulk_count = 0;
 
 /* Percent probability of malloc failure */
 int fail_probability = 0;
 
+/* Deterministic failures, counting allocation attempts since the last reset */
+int fail_nth = 0, fail_every = 0;
+void *fail_site = NULL;
+static atomic_size_t attempts = 0;
+static void *_Atomic nth_site = NULL;
+
+/* State of random failures, apart from that of the C library so that either
+ * can be seeded without disturbing the other
+ */
+static _Atomic uint64_t fail_random_state = 0;
+
+/* Skip filling blocks, registering them in the compact fast registry */
+int fast_mode = 0;
+
+/* Record the call site of every allocation */
+int profile_mode = 0;
+
+/* Place one in guard_rate blocks right before an inaccessible page */
+int guard_rate = 0;
+static atomic_uint guard_count = 0;
+
+/* Hold on to the last quarantine_size freed blocks, as a ring */
+int quarantine_size = 0;
+
+typedef struct {
+    block_element_t *block;
+    bool guarded;
+} quarantined_t;
+
+static quarantined_t *quarantine = NULL;
+static size_t quarantine_cap = 0, quarantine_head = 0, quarantine_count = 0;
+static pthread_mutex_t quarantine_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Call sites are found by open addressing, and never removed */
+#define PROFILE_SITE_BITS 10
+#define PROFILE_SITES (1 << PROFILE_SITE_BITS)
+
+static site_record_t sites[PROFILE_SITES];
+
 static bool cautious_mode = true;
 static bool noallocate_mode = false;
-static bool error_occurred = false;
-static char *error_message = "";
+static atomic_bool error_occurred = false;
+static atomic_bool error_ever = false; /* Even if checked since */
+
+/* Time budget of an operation, in microseconds, 0 for none */
+int time_budget = 1000000;
 
-static int time_limit = 1;
+/* Data for managing exceptions, each thread has its own context */
+static _Thread_local jmp_buf env;
+static _Thread_local volatile sig_atomic_t jmp_ready = false;
+static _Thread_local bool time_limited = false;
+static _Thread_local char *error_message = "";
 
-/* Data for managing exceptions */
-static jmp_buf env;
-static volatile sig_atomic_t jmp_ready = false;
-static bool time_limited = false;
+/* Timing of the operation under way, or the last one */
+static _Thread_local struct timespec op_start;
+static _Thread_local long op_time = 0;
+static _Thread_local size_t op_count = 0;
+#if defined(__linux__)
+#ifndef sigev_notify_thread_id /* Only defined by glibc 2.37 and later */
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+/* Created on first use, then armed and disarmed for every operation */
+static _Thread_local timer_t op_timer;
+static _Thread_local bool op_timer_created = false;
+static _Thread_local bool op_timer_set = false;
+#endif
 
 /* For test_malloc and test_calloc */
 typedef enum {
@@ -67,47 +253,489 @@ typedef enum {
 
 /* Internal functions */
 
-/* Should this allocation fail? */
-static bool fail_allocation()
+/* splitmix64, stepped atomically so that threads can share it */
+static uint64_t fail_random()
+{
+    const uint64_t gamma = 0x9e3779b97f4a7c15;
+    uint64_t x = atomic_fetch_add_explicit(&fail_random_state, gamma,
+                                           memory_order_relaxed) +
+                 gamma;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+    return x ^ (x >> 31);
+}
+
+/* Should this allocation, made from caller, fail? */
+static bool fail_allocation(void *caller)
 {
-    double weight = (double) random() / RAND_MAX;
+    size_t n = atomic_fetch_add_explicit(&attempts, 1, memory_order_relaxed);
+    n++;
+    if (fail_nth > 0 && n == (size_t) fail_nth) {
+        atomic_store_explicit(&nth_site, caller, memory_order_release);
+        return true;
+    }
+    if (fail_every > 0 && n % fail_every == 0)
+        return true;
+    if (fail_site && caller == fail_site)
+        return true;
+
+    if (!fail_probability)
+        return false;
+
+    double weight = (double) (fail_random() >> 11) / (1ULL << 53);
     return (weight < 0.01 * fail_probability);
 }
 
-/* Find header of block, given its payload.
- * Signal error if doesn't seem like legitimate block
+/* Guard pages */
+
+static size_t page_size()
+{
+    static size_t size = 0;
+    if (!size)
+        size = sysconf(_SC_PAGESIZE);
+    return size;
+}
+
+static inline bool guard_sample()
+{
+    if (guard_rate <= 0)
+        return false;
+    unsigned int n =
+        atomic_fetch_add_explicit(&guard_count, 1, memory_order_relaxed);
+    return n % guard_rate == 0;
+}
+
+/* Map storage for a block of bytes bytes followed by an inaccessible page.
+ * The block ends at most 15 bytes short of that page, as its header stays
+ * 16-byte aligned, so that writes past the footer fault at once.
+ */
+static block_element_t *guard_map(size_t bytes)
+{
+    size_t page = page_size();
+    size_t len = (bytes + page - 1) & ~(page - 1);
+    unsigned char *region = mmap(NULL, len + page, PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED)
+        return NULL;
+    if (mprotect(region + len, page, PROT_NONE)) {
+        munmap(region, len + page);
+        return NULL;
+    }
+    return (block_element_t *) (region + ((len - bytes) & ~(size_t) 15));
+}
+
+static void guard_unmap(block_element_t *b)
+{
+    size_t page = page_size();
+    size_t bytes = b->payload_size + sizeof(block_element_t) + sizeof(size_t);
+    size_t len = (bytes + page - 1) & ~(page - 1);
+    munmap((void *) ((uintptr_t) b & ~(page - 1)), len + page);
+}
+
+/* Allocation statistics */
+
+static void stats_alloc(size_t size)
+{
+    size_t live =
+        atomic_fetch_add_explicit(&live_bytes, size, memory_order_relaxed);
+    live += size;
+    size_t peak = atomic_load_explicit(&peak_bytes, memory_order_relaxed);
+    while (live > peak &&
+           !atomic_compare_exchange_weak(&peak_bytes, &peak, live))
+        ;
+
+    /* Class k holds sizes in [2^(k-1), 2^k), class 0 empty blocks */
+    size_t k = size ? 64 - __builtin_clzl(size) : 0;
+    if (k >= ALLOC_SIZE_CLASSES)
+        k = ALLOC_SIZE_CLASSES - 1;
+    atomic_fetch_add_explicit(&size_classes[k], 1, memory_order_relaxed);
+}
+
+static inline void stats_free(size_t size)
+{
+    atomic_fetch_sub_explicit(&live_bytes, size, memory_order_relaxed);
+}
+
+/* Allocation profiling */
+
+/* Find the record of a call site, claiming a free one for a new site.
+ * Return NULL once every record is taken.
+ */
+static site_record_t *profile_site(void *caller)
+{
+    size_t i = ((uintptr_t) caller * 0x9E3779B97F4A7C15ULL) >>
+               (64 - PROFILE_SITE_BITS);
+    for (size_t n = 0; n < PROFILE_SITES; n++) {
+        site_record_t *r = &sites[(i + n) & (PROFILE_SITES - 1)];
+        void *site = atomic_load_explicit(&r->site, memory_order_acquire);
+        if (!site &&
+            atomic_compare_exchange_strong(&r->site, &site, caller))
+            return r;
+        if (site == caller)
+            return r;
+    }
+    return NULL;
+}
+
+/* Account for an allocation of size bytes made from caller, and return the
+ * record to charge its release to, if it is to be tracked while live
+ */
+static site_record_t *profile_alloc(void *caller, size_t size, bool live)
+{
+    site_record_t *r = profile_site(caller);
+    if (!r)
+        return NULL;
+
+    atomic_fetch_add_explicit(&r->allocs, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&r->bytes, size, memory_order_relaxed);
+    if (!live)
+        return NULL;
+    atomic_fetch_add_explicit(&r->live_blocks, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&r->live_bytes, size, memory_order_relaxed);
+    return r;
+}
+
+static void profile_release(site_record_t *r, size_t size)
+{
+    atomic_fetch_sub_explicit(&r->live_blocks, 1, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&r->live_bytes, size, memory_order_relaxed);
+}
+
+/* Registry of allocated blocks */
+
+/* Blocks are 16-byte aligned and at least 48 bytes long, so the low bits of
+ * their address above the alignment pick a shard, and within a shard every
+ * block owns a distinct value of the remaining bits. Those make the slot,
+ * folding the bits above the table size in. Unlike a multiplicative hash,
+ * this keeps blocks allocated next to each other in nearby slots, so walking
+ * a list of blocks does not miss the cache twice per block.
+ */
+static inline registry_t *registry_shard(const block_element_t *b)
+{
+    return &registry[((uintptr_t) b >> 4) & (REGISTRY_SHARDS - 1)];
+}
+
+static inline size_t registry_hash(const registry_t *r,
+                                   const block_element_t *b)
+{
+    size_t key = (uintptr_t) b >> (4 + REGISTRY_SHARD_BITS);
+    return (key ^ (key >> __builtin_ctzl(r->size))) & (r->size - 1);
+}
+
+static inline void registry_lock(atomic_flag *lock)
+{
+    while (atomic_flag_test_and_set_explicit(lock, memory_order_acquire))
+        ;
+}
+
+static inline void registry_unlock(atomic_flag *lock)
+{
+    atomic_flag_clear_explicit(lock, memory_order_release);
+}
+
+/* Return the slot holding b, or the empty slot ending its probe sequence */
+static block_element_t **registry_slot(registry_t *r, const block_element_t *b)
+{
+    size_t mask = r->size - 1;
+    size_t i = registry_hash(r, b);
+    while (r->slots[i] && r->slots[i] != b)
+        i = (i + 1) & mask;
+    return &r->slots[i];
+}
+
+static bool registry_lookup(registry_t *r, const block_element_t *b)
+{
+    return r->size && *registry_slot(r, b) == b;
+}
+
+/* Rehash every block of the shard into a table of new_size slots */
+static bool registry_resize(registry_t *r, size_t new_size)
+{
+    block_element_t **old = r->slots;
+    size_t old_size = r->size;
+
+    r->slots = calloc(new_size, sizeof(block_element_t *));
+    if (!r->slots) {
+        r->slots = old;
+        return false;
+    }
+    r->size = new_size;
+
+    for (size_t i = 0; i < old_size; i++) {
+        if (old[i])
+            *registry_slot(r, old[i]) = old[i];
+    }
+    free(old);
+    return true;
+}
+
+static bool registry_add(block_element_t *b)
+{
+    registry_t *r = registry_shard(b);
+    bool ok = true;
+
+    registry_lock(&r->lock);
+    /* Keep the load factor at most 1/2 */
+    if (2 * (r->count + 1) > r->size)
+        ok = registry_resize(r, r->size ? 2 * r->size : REGISTRY_MIN_SIZE);
+    if (ok) {
+        *registry_slot(r, b) = b;
+        r->count++;
+    }
+    registry_unlock(&r->lock);
+    return ok;
+}
+
+/* Return whether b was found in the registry */
+static bool registry_remove(const block_element_t *b)
+{
+    registry_t *r = registry_shard(b);
+
+    registry_lock(&r->lock);
+    if (!registry_lookup(r, b)) {
+        registry_unlock(&r->lock);
+        return false;
+    }
+
+    /* Backward shift deletion: pull later entries of the probe sequence into
+     * the hole, so that lookups never need tombstones.
+     */
+    size_t mask = r->size - 1;
+    size_t hole = registry_slot(r, b) - r->slots;
+    for (size_t i = (hole + 1) & mask; r->slots[i]; i = (i + 1) & mask) {
+        size_t home = registry_hash(r, r->slots[i]);
+        /* Move entry i unless its home lies cyclically in (hole, i] */
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            r->slots[hole] = r->slots[i];
+            hole = i;
+        }
+    }
+    r->slots[hole] = NULL;
+    r->count--;
+
+    /* Give memory back once most blocks are gone */
+    if (r->size > REGISTRY_MIN_SIZE && 8 * r->count < r->size)
+        registry_resize(r, r->size / 2);
+    registry_unlock(&r->lock);
+    return true;
+}
+
+static bool fast_registry_add(block_element_t *b)
+{
+    registry_lock(&fast_registry.lock);
+    uint32_t i = fast_registry.free;
+    if (i != FAST_SLOT_NONE) {
+        fast_registry.free = fast_registry.slots[i] >> 1;
+    } else {
+        if (fast_registry.used == fast_registry.size) {
+            uint32_t size = fast_registry.size ? 2 * fast_registry.size
+                                               : REGISTRY_MIN_SIZE;
+            uintptr_t *slots = NULL;
+            /* Indices are 32 bits wide */
+            if (size > fast_registry.size)
+                slots = realloc(fast_registry.slots, size * sizeof(uintptr_t));
+            if (!slots) {
+                registry_unlock(&fast_registry.lock);
+                return false;
+            }
+            fast_registry.slots = slots;
+            fast_registry.size = size;
+        }
+        i = fast_registry.used++;
+    }
+    fast_registry.slots[i] = (uintptr_t) b;
+    registry_unlock(&fast_registry.lock);
+    b->fast_slot = i;
+    return true;
+}
+
+/* Return whether b was found in the fast registry */
+static bool fast_registry_remove(const block_element_t *b)
+{
+    uint32_t i = b->fast_slot;
+    registry_lock(&fast_registry.lock);
+    bool found = i < fast_registry.used &&
+                 fast_registry.slots[i] == (uintptr_t) b;
+    if (found) {
+        fast_registry.slots[i] = (uintptr_t) fast_registry.free << 1 | 1;
+        fast_registry.free = i;
+    }
+    registry_unlock(&fast_registry.lock);
+    return found;
+}
+
+/* Chunk table */
+
+/* Units of a chunk are numbered consecutively, so they hash to distinct
+ * slots as they are
+ */
+static chunk_slot_t *chunk_slot(uintptr_t unit)
+{
+    size_t mask = chunk_table.size - 1;
+    size_t i = unit & mask;
+    while (chunk_table.slots[i].unit && chunk_table.slots[i].unit != unit)
+        i = (i + 1) & mask;
+    return &chunk_table.slots[i];
+}
+
+static bool chunk_table_resize(size_t new_size)
+{
+    chunk_slot_t *old = chunk_table.slots;
+    size_t old_size = chunk_table.size;
+
+    chunk_table.slots = calloc(new_size, sizeof(chunk_slot_t));
+    if (!chunk_table.slots) {
+        chunk_table.slots = old;
+        return false;
+    }
+    chunk_table.size = new_size;
+
+    for (size_t i = 0; i < old_size; i++) {
+        if (old[i].unit)
+            *chunk_slot(old[i].unit) = old[i];
+    }
+    free(old);
+    return true;
+}
+
+/* Enter every unit of chunk in the table, as live or as released */
+static bool chunk_table_mark(arena_chunk_t *chunk, bool live)
+{
+    uintptr_t first = (uintptr_t) chunk >> ARENA_CHUNK_SHIFT;
+    uintptr_t last = ((uintptr_t) chunk->data + chunk->size - 1) >>
+                     ARENA_CHUNK_SHIFT;
+    bool ok = true;
+
+    registry_lock(&chunk_table.lock);
+    for (uintptr_t unit = first; unit <= last; unit++) {
+        chunk_slot_t *slot = chunk_table.size ? chunk_slot(unit) : NULL;
+        if (!slot || !slot->unit) {
+            /* Keep the load factor at most 1/2 */
+            size_t size = chunk_table.size;
+            if (2 * (chunk_table.count + 1) > size &&
+                !chunk_table_resize(size ? 2 * size : CHUNK_TABLE_MIN_SIZE)) {
+                ok = false;
+                break;
+            }
+            slot = chunk_slot(unit);
+            slot->unit = unit;
+            chunk_table.count++;
+        }
+
+        if (slot->chunk)
+            chunk_table.units--;
+        if (slot->released)
+            chunk_table.released--;
+        slot->chunk = live ? chunk : NULL;
+        slot->released = !live;
+        if (live)
+            chunk_table.units++;
+        else
+            chunk_table.released++;
+    }
+    registry_unlock(&chunk_table.lock);
+    return ok;
+}
+
+/* Return the live chunk holding address p, or NULL, telling through released
+ * whether p lies in a chunk that was released instead
+ */
+static arena_chunk_t *chunk_find(const void *p, bool *released)
+{
+    *released = false;
+    if (!chunk_table.units && !chunk_table.released)
+        return NULL;
+
+    registry_lock(&chunk_table.lock);
+    chunk_slot_t *slot = chunk_slot((uintptr_t) p >> ARENA_CHUNK_SHIFT);
+    arena_chunk_t *chunk = slot->chunk;
+    *released = slot->released;
+    registry_unlock(&chunk_table.lock);
+    return chunk;
+}
+
+/* The heap handed out block b, which no released chunk may hold any more */
+static void chunk_reclaim(const block_element_t *b)
+{
+    if (!chunk_table.released)
+        return;
+
+    registry_lock(&chunk_table.lock);
+    chunk_slot_t *slot = chunk_slot((uintptr_t) b >> ARENA_CHUNK_SHIFT);
+    if (slot->released) {
+        slot->released = false;
+        chunk_table.released--;
+    }
+    registry_unlock(&chunk_table.lock);
+}
+
+/* Find header of block, given its payload, and take it out of the registry.
+ * Signal error and return NULL if doesn't seem like legitimate block
  */
 static block_element_t *find_header(void *p)
 {
     if (!p) {
         report_event(MSG_ERROR, "Attempting to free null block");
         error_occurred = true;
+        return NULL;
     }
 
     block_element_t *b =
         (block_element_t *) ((size_t) p - sizeof(block_element_t));
-    if (cautious_mode) {
-        /* Make sure this is really an allocated block */
-        block_element_t *ab = allocated;
-        bool found = false;
-        while (ab && !found) {
-            found = ab == b;
-            ab = ab->next;
+
+    /* Blocks of released arenas are no longer mapped, so look the address up
+     * before reading the header
+     */
+    bool released;
+    arena_chunk_t *chunk = chunk_find(b, &released);
+    if (released) {
+        report_event(MSG_ERROR,
+                     "Attempted to free block of released arena.  "
+                     "Address = %p",
+                     p);
+        error_occurred = true;
+        return NULL;
+    }
+    if (chunk) {
+        if ((unsigned char *) b < chunk->data ||
+            (unsigned char *) p > chunk->data + chunk->used ||
+            b->magic_header != MAGICARENA) {
+            report_event(MSG_ERROR,
+                         "Attempted to free unallocated arena block.  "
+                         "Address = %p",
+                         p);
+            error_occurred = true;
+            return NULL;
         }
-        if (!found) {
+        return b;
+    }
+
+    if (b->magic_header == MAGICFAST) {
+        if (!fast_registry_remove(b)) {
             report_event(MSG_ERROR,
                          "Attempted to free unallocated block.  Address = %p",
                          p);
             error_occurred = true;
+            return NULL;
         }
+        return b;
     }
 
-    if (b->magic_header != MAGICHEADER) {
+    /* Make sure this is really an allocated block */
+    if (!registry_remove(b) && cautious_mode) {
+        report_event(MSG_ERROR,
+                     "Attempted to free unallocated block.  Address = %p", p);
+        error_occurred = true;
+        return NULL;
+    }
+
+    if (b->magic_header != MAGICHEADER && b->magic_header != MAGICGUARD) {
         report_event(
             MSG_ERROR,
             "Attempted to free unallocated or corrupted block.  Address = %p",
             p);
         error_occurred = true;
+        return NULL;
     }
 
     return b;
@@ -122,7 +750,37 @@ static size_t *find_footer(block_element_t *b)
     return p;
 }
 
-static void *alloc(alloc_t alloc_type, size_t size)
+static void *arena_carve(arena_t *arena, size_t bytes);
+
+/* Blocks of merged arenas are accounted for by the arena they merged into */
+static inline arena_t *arena_root(arena_t *arena)
+{
+    while (arena->parent)
+        arena = arena->parent;
+    return arena;
+}
+
+/* Room taken within its chunk by an arena block of size payload bytes */
+static inline size_t arena_block_bytes(size_t size)
+{
+    return (sizeof(block_element_t) + size + sizeof(size_t) + 15) &
+           ~(size_t) 15;
+}
+
+/* Keep a block no longer in use for the next allocation of its size */
+static void arena_recycle(arena_t *arena, block_element_t *b)
+{
+    size_t k = arena_block_bytes(b->payload_size) / 16;
+    if (k >= ARENA_FREE_CLASSES)
+        return;
+    *(block_element_t **) b->payload = arena->free_blocks[k];
+    arena->free_blocks[k] = b;
+}
+
+static void *alloc(alloc_t alloc_type,
+                   size_t size,
+                   arena_t *arena,
+                   void *caller)
 {
     if (noallocate_mode) {
         char *msg_alloc_forbidden[] = {
@@ -133,7 +791,7 @@ static void *alloc(alloc_t alloc_type, size_t size)
         return NULL;
     }
 
-    if (fail_allocation()) {
+    if (fail_allocation(caller)) {
         char *msg_alloc_failure[] = {
             "Malloc returning NULL",
             "Calloc returning NULL",
@@ -142,8 +800,18 @@ static void *alloc(alloc_t alloc_type, size_t size)
         return NULL;
     }
 
-    block_element_t *new_block =
-        malloc(size + sizeof(block_element_t) + sizeof(size_t));
+    size_t bytes = size + sizeof(block_element_t) + sizeof(size_t);
+    bool guarded = !arena && guard_sample();
+    block_element_t *new_block = NULL;
+    if (arena)
+        new_block = arena_carve(arena, bytes);
+    else if (guarded)
+        new_block = guard_map(bytes);
+    if (!new_block && !arena) {
+        /* Running out of mappings is no reason to fail */
+        guarded = false;
+        new_block = malloc(bytes);
+    }
     if (!new_block) {
         report_event(MSG_FATAL, "Couldn't allocate any more memory");
         error_occurred = true;
@@ -153,27 +821,138 @@ static void *alloc(alloc_t alloc_type, size_t size)
     new_block->magic_header = MAGICHEADER;
     // cppcheck-suppress nullPointerRedundantCheck
     new_block->payload_size = size;
+    new_block->site = profile_mode ? profile_alloc(caller, size, !arena) : NULL;
     *find_footer(new_block) = MAGICFOOTER;
     void *p = (void *) &new_block->payload;
-    memset(p, !alloc_type * FILLCHAR, size);
-    // cppcheck-suppress nullPointerRedundantCheck
-    new_block->next = allocated;
+    if (!fast_mode || alloc_type == TEST_CALLOC)
+        memset(p, !alloc_type * FILLCHAR, size);
+    allocated_count++;
+    stats_alloc(size);
+
+    if (arena) {
+        new_block->magic_header = MAGICARENA;
+        new_block->arena = arena;
+        arena->live_count++;
+        arena->live_bytes += size;
+        return p;
+    }
+
     // cppcheck-suppress nullPointerRedundantCheck
-    new_block->prev = NULL;
+    new_block->arena = NULL;
+    chunk_reclaim(new_block);
+    if (guarded) {
+        new_block->magic_header = MAGICGUARD;
+    } else if (fast_mode) {
+        new_block->magic_header = MAGICFAST;
+        if (!fast_registry_add(new_block)) {
+            report_event(MSG_FATAL, "Couldn't allocate any more memory");
+            error_occurred = true;
+        }
+        return p;
+    }
 
-    if (allocated)
-        allocated->prev = new_block;
-    allocated = new_block;
-    allocated_count++;
+    if (!registry_add(new_block)) {
+        report_event(MSG_FATAL, "Couldn't allocate any more memory");
+        error_occurred = true;
+    }
 
     return p;
 }
 
+/* Quarantine of freed blocks.
+ * Freed blocks are poisoned, then kept away from the C library for a while.
+ * Any write to them meanwhile shows when they leave the quarantine.
+ */
+
+static void release_block(block_element_t *b, bool guarded)
+{
+    if (guarded)
+        guard_unmap(b);
+    else
+        free(b);
+}
+
+/* Check that a block was left alone while in quarantine, then release it */
+static void quarantine_evict(const quarantined_t *q)
+{
+    block_element_t *b = q->block;
+    if (b->magic_header != MAGICFREE) {
+        /* Size can't be trusted, better leak a guarded mapping */
+        report_event(MSG_ERROR,
+                     "Header of block with address %p was overwritten after "
+                     "it was freed",
+                     (void *) b->payload);
+        error_occurred = true;
+        if (!q->guarded)
+            free(b);
+        return;
+    }
+
+    unsigned char *p = b->payload;
+    size_t n = b->payload_size;
+    /* All bytes are equal to the first one if it matches its successor */
+    if (*find_footer(b) != MAGICFREE ||
+        (n && (p[0] != FILLCHAR || memcmp(p, p + 1, n - 1)))) {
+        report_event(MSG_ERROR,
+                     "Block with address %p was written to after it was freed",
+                     (void *) p);
+        error_occurred = true;
+    }
+    release_block(b, q->guarded);
+}
+
+static void quarantine_drain()
+{
+    while (quarantine_count) {
+        quarantine_evict(&quarantine[quarantine_head]);
+        quarantine_head = (quarantine_head + 1) % quarantine_cap;
+        quarantine_count--;
+    }
+    quarantine_head = 0;
+}
+
+/* Return whether the block was taken into quarantine */
+static bool quarantine_push(block_element_t *b, bool guarded)
+{
+    pthread_mutex_lock(&quarantine_lock);
+    if (quarantine_cap != (size_t) quarantine_size) {
+        /* Size was changed, start over with a ring of the new size */
+        quarantine_drain();
+        free(quarantine);
+        quarantine = malloc(quarantine_size * sizeof(quarantined_t));
+        quarantine_cap = quarantine ? quarantine_size : 0;
+    }
+    if (!quarantine_cap) {
+        pthread_mutex_unlock(&quarantine_lock);
+        return false;
+    }
+
+    if (quarantine_count == quarantine_cap) {
+        quarantine_evict(&quarantine[quarantine_head]);
+        quarantine_head = (quarantine_head + 1) % quarantine_cap;
+        quarantine_count--;
+    }
+    quarantined_t *q =
+        &quarantine[(quarantine_head + quarantine_count) % quarantine_cap];
+    q->block = b;
+    q->guarded = guarded;
+    quarantine_count++;
+    pthread_mutex_unlock(&quarantine_lock);
+    return true;
+}
+
+void quarantine_flush()
+{
+    pthread_mutex_lock(&quarantine_lock);
+    quarantine_drain();
+    pthread_mutex_unlock(&quarantine_lock);
+}
+
 /* Implementation of application functions */
 
 void *test_malloc(size_t size)
 {
-    return alloc(TEST_MALLOC, size);
+    return alloc(TEST_MALLOC, size, NULL, __builtin_return_address(0));
 }
 
 // cppcheck-suppress unusedFunction
@@ -184,7 +963,8 @@ void *test_calloc(size_t nelem, size_t elsize)
      */
     if (!nelem || !elsize || nelem > SIZE_MAX / elsize)
         return NULL;
-    return alloc(TEST_CALLOC, nelem * elsize);
+    return alloc(TEST_CALLOC, nelem * elsize, NULL,
+                 __builtin_return_address(0));
 }
 
 void test_free(void *p)
@@ -198,6 +978,9 @@ void test_free(void *p)
         return;
 
     block_element_t *b = find_header(p);
+    if (!b)
+        return;
+
     size_t footer = *find_footer(b);
     if (footer != MAGICFOOTER) {
         report_event(MSG_ERROR,
@@ -206,40 +989,423 @@ void test_free(void *p)
                      p);
         error_occurred = true;
     }
+    if (b->site)
+        profile_release(b->site, b->payload_size);
+    bool in_arena = b->magic_header == MAGICARENA;
+    bool guarded = b->magic_header == MAGICGUARD;
     b->magic_header = MAGICFREE;
     *find_footer(b) = MAGICFREE;
-    memset(p, FILLCHAR, b->payload_size);
+    /* Quarantined blocks are poisoned, even in fast mode */
+    if (!fast_mode || quarantine_size > 0)
+        memset(p, FILLCHAR, b->payload_size);
+    allocated_count--;
+    stats_free(b->payload_size);
 
-    /* Unlink from list */
-    block_element_t *bn = b->next;
-    block_element_t *bp = b->prev;
-    if (bp)
-        bp->next = bn;
-    else
-        allocated = bn;
-    if (bn)
-        bn->prev = bp;
+    if (in_arena) {
+        /* Storage is given back when the whole arena is released */
+        arena_t *a = arena_root(b->arena);
+        a->live_count--;
+        a->live_bytes -= b->payload_size;
+        arena_recycle(a, b);
+        return;
+    }
 
-    free(b);
-    allocated_count--;
+    if (quarantine_size > 0 && quarantine_push(b, guarded))
+        return;
+    release_block(b, guarded);
 }
 
 // cppcheck-suppress unusedFunction
 char *test_strdup(const char *s)
 {
     size_t len = strlen(s) + 1;
-    void *new = test_malloc(len);
+    void *new = alloc(TEST_MALLOC, len, NULL, __builtin_return_address(0));
     if (!new)
         return NULL;
 
     return memcpy(new, s, len);
 }
 
+/* Resize a block carved from an arena.
+ * The block is resized in place when it is the last one carved from the
+ * newest chunk and that chunk has room left, moved to fresh space otherwise.
+ * The last block gives back the room it no longer needs, so that it can grow
+ * in place again, while others keep it until the arena is released.
+ * A block moved elsewhere is left for reuse.
+ */
+static block_element_t *arena_resize(block_element_t *b, size_t bytes)
+{
+    arena_t *root = arena_root(b->arena);
+
+    size_t old_bytes = arena_block_bytes(b->payload_size);
+    size_t new_bytes = (bytes + 15) & ~(size_t) 15;
+    arena_chunk_t *chunk = root->chunks;
+    bool last =
+        chunk && (unsigned char *) b + old_bytes == chunk->data + chunk->used;
+    if (new_bytes <= old_bytes) {
+        if (last)
+            chunk->used -= old_bytes - new_bytes;
+        return b;
+    }
+
+    if (last && chunk->size - chunk->used >= new_bytes - old_bytes) {
+        chunk->used += new_bytes - old_bytes;
+        return b;
+    }
+
+    block_element_t *nb = arena_carve(root, bytes);
+    if (!nb)
+        return NULL;
+    memcpy(nb, b, sizeof(block_element_t) + b->payload_size);
+    b->magic_header = MAGICFREE;
+    *find_footer(b) = MAGICFREE;
+    memset(b->payload, FILLCHAR, b->payload_size);
+    arena_recycle(root, b);
+    return nb;
+}
+
+// cppcheck-suppress unusedFunction
+void *test_realloc(void *p, size_t size)
+{
+    if (!p)
+        return alloc(TEST_MALLOC, size, NULL, __builtin_return_address(0));
+
+    if (!size) {
+        test_free(p);
+        return NULL;
+    }
+
+    if (noallocate_mode) {
+        report_event(MSG_FATAL, "Calls to realloc are disallowed");
+        return NULL;
+    }
+
+    /* On failure the original block is left untouched, as realloc does */
+    if (fail_allocation(__builtin_return_address(0))) {
+        report_event(MSG_WARN, "Realloc returning NULL");
+        return NULL;
+    }
+
+    block_element_t *b = find_header(p);
+    if (!b)
+        return NULL;
+
+    if (*find_footer(b) != MAGICFOOTER) {
+        report_event(MSG_ERROR,
+                     "Corruption detected in block with address %p when "
+                     "attempting to reallocate it",
+                     p);
+        error_occurred = true;
+    }
+
+    size_t old_size = b->payload_size;
+    site_record_t *old_site = b->site;
+    size_t bytes = size + sizeof(block_element_t) + sizeof(size_t);
+    block_element_t *new_block;
+    if (b->magic_header == MAGICARENA) {
+        new_block = arena_resize(b, bytes);
+    } else if (b->magic_header == MAGICFAST) {
+        new_block = realloc(b, bytes);
+        if (!fast_registry_add(new_block ? new_block : b))
+            error_occurred = true;
+    } else if (b->magic_header == MAGICGUARD) {
+        /* Move the block, to keep it right before a guard page */
+        new_block = guard_map(bytes);
+        bool guarded = new_block;
+        if (!guarded) {
+            /* Running out of mappings is no reason to fail */
+            new_block = malloc(bytes);
+        }
+        if (new_block) {
+            memcpy(new_block, b,
+                   sizeof(block_element_t) +
+                       (size < old_size ? size : old_size));
+            guard_unmap(b);
+            if (!guarded)
+                new_block->magic_header = MAGICHEADER;
+        }
+        if (!registry_add(new_block ? new_block : b))
+            error_occurred = true;
+    } else {
+        /* Let the C library grow the block in place when it can */
+        new_block = realloc(b, bytes);
+        if (!registry_add(new_block ? new_block : b))
+            error_occurred = true;
+    }
+    if (!new_block) {
+        report_event(MSG_FATAL, "Couldn't allocate any more memory");
+        error_occurred = true;
+        return NULL;
+    }
+
+    stats_free(old_size);
+    stats_alloc(size);
+    if (new_block->magic_header == MAGICARENA) {
+        arena_t *a = arena_root(new_block->arena);
+        a->live_bytes += size;
+        a->live_bytes -= old_size;
+    } else {
+        chunk_reclaim(new_block);
+    }
+    if (old_site)
+        profile_release(old_site, old_size);
+    new_block->site =
+        profile_mode ? profile_alloc(__builtin_return_address(0), size,
+                                     !new_block->arena)
+                     : NULL;
+    new_block->payload_size = size;
+    *find_footer(new_block) = MAGICFOOTER;
+    if (size > old_size && !fast_mode)
+        memset(new_block->payload + old_size, FILLCHAR, size - old_size);
+    return new_block->payload;
+}
+
+/* Arenas */
+
+/* Reserve bytes within the newest chunk of arena, adding a chunk if needed,
+ * unless a block of that size was freed earlier
+ */
+static void *arena_carve(arena_t *arena, size_t bytes)
+{
+    /* Keep every block aligned like malloc would */
+    bytes = (bytes + 15) & ~(size_t) 15;
+
+    size_t k = bytes / 16;
+    if (k < ARENA_FREE_CLASSES && arena->free_blocks[k]) {
+        block_element_t *b = arena->free_blocks[k];
+        arena->free_blocks[k] = *(block_element_t **) b->payload;
+        return b;
+    }
+
+    arena_chunk_t *chunk = arena->chunks;
+    if (!chunk || chunk->size - chunk->used < bytes) {
+        size_t size = (sizeof(arena_chunk_t) + bytes + ARENA_CHUNK_SIZE - 1) &
+                      ~(size_t) (ARENA_CHUNK_SIZE - 1);
+        if (posix_memalign((void **) &chunk, ARENA_CHUNK_SIZE, size))
+            return NULL;
+        chunk->used = 0;
+        chunk->size = size - sizeof(arena_chunk_t);
+        if (!chunk_table_mark(chunk, true)) {
+            /* Units entered already must not point to the chunk any more */
+            chunk_table_mark(chunk, false);
+            free(chunk);
+            return NULL;
+        }
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+    }
+
+    void *p = chunk->data + chunk->used;
+    chunk->used += bytes;
+    return p;
+}
+
+arena_t *test_arena_new(void)
+{
+    if (noallocate_mode) {
+        report_event(MSG_FATAL, "Calls to malloc are disallowed");
+        return NULL;
+    }
+
+    if (fail_allocation(__builtin_return_address(0))) {
+        report_event(MSG_WARN, "Arena creation returning NULL");
+        return NULL;
+    }
+
+    arena_t *arena = malloc(sizeof(arena_t));
+    if (!arena) {
+        report_event(MSG_FATAL, "Couldn't allocate any more memory");
+        error_occurred = true;
+        return NULL;
+    }
+    arena->chunks = NULL;
+    memset(arena->free_blocks, 0, sizeof(arena->free_blocks));
+    arena->live_count = 0;
+    arena->live_bytes = 0;
+    arena->parent = arena->merged = NULL;
+
+    /* The arena itself counts as one block until it is released */
+    allocated_count++;
+    return arena;
+}
+
+void *test_arena_malloc(arena_t *arena, size_t size)
+{
+    return alloc(TEST_MALLOC, size, arena, __builtin_return_address(0));
+}
+
+char *test_arena_strdup(arena_t *arena, const char *s)
+{
+    size_t len = strlen(s) + 1;
+    void *new = alloc(TEST_MALLOC, len, arena, __builtin_return_address(0));
+    if (!new)
+        return NULL;
+
+    return memcpy(new, s, len);
+}
+
+void test_arena_merge(arena_t *dst, arena_t *src)
+{
+    if (!dst || !src || dst == src)
+        return;
+
+    /* Move the chunks over, keeping the partly used chunk of dst in front */
+    arena_chunk_t **tail = &src->chunks;
+    while (*tail)
+        tail = &(*tail)->next;
+    if (dst->chunks) {
+        *tail = dst->chunks->next;
+        dst->chunks->next = src->chunks;
+    } else {
+        dst->chunks = src->chunks;
+    }
+    src->chunks = NULL;
+
+    /* Blocks freed from src may be reused by dst */
+    for (int k = 0; k < ARENA_FREE_CLASSES; k++) {
+        block_element_t **last = &src->free_blocks[k];
+        while (*last)
+            last = (block_element_t **) (*last)->payload;
+        *last = dst->free_blocks[k];
+        dst->free_blocks[k] = src->free_blocks[k];
+        src->free_blocks[k] = NULL;
+    }
+
+    dst->live_count += src->live_count;
+    dst->live_bytes += src->live_bytes;
+    src->live_count = 0;
+    src->live_bytes = 0;
+    src->parent = dst;
+
+    /* Hand src, along with whatever was merged into it, over to dst */
+    arena_t **last = &src->merged;
+    while (*last)
+        last = &(*last)->merged_next;
+    *last = dst->merged;
+    dst->merged = src;
+    src->merged_next = src->merged;
+    src->merged = NULL;
+}
+
+/* Give the storage of arena back, remembering where its chunks were */
+static void arena_release(arena_t *arena)
+{
+    arena_chunk_t *chunk = arena->chunks;
+    while (chunk) {
+        arena_chunk_t *next = chunk->next;
+        /* Should the table not grow, later frees are merely not recognized */
+        chunk_table_mark(chunk, false);
+        free(chunk);
+        chunk = next;
+    }
+
+    free(arena);
+    allocated_count--;
+}
+
+void test_arena_free(arena_t *arena)
+{
+    if (!arena)
+        return;
+
+    if (noallocate_mode) {
+        report_event(MSG_FATAL, "Calls to free disallowed");
+        return;
+    }
+
+    if (arena->parent) {
+        report_event(MSG_ERROR, "Attempted to free arena merged into another");
+        error_occurred = true;
+        return;
+    }
+
+    /* Blocks still carved from the arena are released along with it */
+    allocated_count -= arena->live_count;
+    arena_bulk_count += arena->live_count;
+    stats_free(arena->live_bytes);
+
+    arena_t *merged = arena->merged;
+    while (merged) {
+        arena_t *next = merged->merged_next;
+        arena_release(merged);
+        merged = next;
+    }
+    arena_release(arena);
+}
+
 size_t allocation_check()
 {
     return allocated_count;
 }
 
+size_t arena_bulk_check()
+{
+    return arena_bulk_count;
+}
+
+void fail_injection_seed(unsigned int seed)
+{
+    atomic_store_explicit(&fail_random_state, seed, memory_order_relaxed);
+}
+
+void fail_injection_reset()
+{
+    atomic_store_explicit(&attempts, 0, memory_order_relaxed);
+    atomic_store_explicit(&nth_site, NULL, memory_order_release);
+}
+
+size_t allocation_attempts(void **site)
+{
+    *site = atomic_load_explicit(&nth_site, memory_order_acquire);
+    return atomic_load_explicit(&attempts, memory_order_relaxed);
+}
+
+void allocation_stats(alloc_stats_t *stats)
+{
+    stats->live_bytes = live_bytes;
+    stats->peak_bytes = peak_bytes;
+    stats->allocs = 0;
+    for (int k = 0; k < ALLOC_SIZE_CLASSES; k++) {
+        stats->size_classes[k] = size_classes[k];
+        stats->allocs += size_classes[k];
+    }
+}
+
+/* Called before every command, so stores are relaxed, sequentially consistent
+ * ones costing a full barrier each
+ */
+void allocation_stats_reset()
+{
+    atomic_store_explicit(&peak_bytes, live_bytes, memory_order_relaxed);
+    for (int k = 0; k < ALLOC_SIZE_CLASSES; k++)
+        atomic_store_explicit(&size_classes[k], 0, memory_order_relaxed);
+}
+
+static int cmp_site_bytes(const void *a, const void *b)
+{
+    size_t x = ((const alloc_site_t *) a)->bytes;
+    size_t y = ((const alloc_site_t *) b)->bytes;
+    return (x < y) - (x > y);
+}
+
+size_t allocation_profile(alloc_site_t *out, size_t max)
+{
+    size_t n = 0;
+    for (size_t i = 0; i < PROFILE_SITES && n < max; i++) {
+        site_record_t *r = &sites[i];
+        if (!r->site)
+            continue;
+        out[n].site = r->site;
+        out[n].allocs = r->allocs;
+        out[n].bytes = r->bytes;
+        out[n].live_blocks = r->live_blocks;
+        out[n].live_bytes = r->live_bytes;
+        n++;
+    }
+    qsort(out, n, sizeof(alloc_site_t), cmp_site_bytes);
+    return n;
+}
+
 /* Implementation of functions for testing */
 
 /* Set/unset cautious mode.
@@ -261,11 +1427,80 @@ void set_noallocate_mode(bool noallocate)
 /* Return whether any errors have occurred since last time set error limit */
 bool error_check()
 {
-    bool e = error_occurred;
-    error_occurred = false;
+    bool e = atomic_exchange(&error_occurred, false);
+    if (e)
+        error_ever = true;
     return e;
 }
 
+bool error_seen()
+{
+    return error_ever || error_occurred;
+}
+
+/* Start timing an operation, arranging for SIGALRM to be delivered to this
+ * thread once it runs over budget
+ */
+static void op_timer_start()
+{
+    clock_gettime(CLOCK_MONOTONIC, &op_start);
+    if (time_budget <= 0)
+        return;
+
+    struct itimerspec budget = {
+        .it_value.tv_sec = time_budget / 1000000,
+        .it_value.tv_nsec = time_budget % 1000000 * 1000L,
+    };
+#if defined(__linux__)
+    struct sigevent sev = {
+        .sigev_notify = SIGEV_THREAD_ID,
+        .sigev_signo = SIGALRM,
+    };
+    sev.sigev_notify_thread_id = gettid();
+    if (!op_timer_created && timer_create(CLOCK_MONOTONIC, &sev, &op_timer))
+        return;
+    op_timer_created = true;
+    op_timer_set = true;
+    timer_settime(op_timer, 0, &budget, NULL);
+#else
+    struct itimerval timer = {
+        .it_value.tv_sec = budget.it_value.tv_sec,
+        .it_value.tv_usec = budget.it_value.tv_nsec / 1000,
+    };
+    setitimer(ITIMER_REAL, &timer, NULL);
+#endif
+}
+
+static void op_timer_stop()
+{
+#if defined(__linux__)
+    if (op_timer_set) {
+        struct itimerspec disarm = {0};
+        timer_settime(op_timer, 0, &disarm, NULL);
+        op_timer_set = false;
+    }
+#else
+    struct itimerval timer = {0};
+    setitimer(ITIMER_REAL, &timer, NULL);
+#endif
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    op_time = (now.tv_sec - op_start.tv_sec) * 1000000L +
+              (now.tv_nsec - op_start.tv_nsec) / 1000;
+    op_count++;
+}
+
+long last_op_time()
+{
+    return op_time;
+}
+
+size_t timed_ops()
+{
+    return op_count;
+}
+
 /* Prepare for a risky operation using setjmp.
  * Function returns true for initial return, false for error return
  */
@@ -275,7 +1510,7 @@ bool exception_setup(bool limit_time)
         /* Got here from longjmp */
         jmp_ready = false;
         if (time_limited) {
-            alarm(0);
+            op_timer_stop();
             time_limited = false;
         }
 
@@ -288,7 +1523,7 @@ bool exception_setup(bool limit_time)
     /* Got here from initial call */
     jmp_ready = true;
     if (limit_time) {
-        alarm(time_limit);
+        op_timer_start();
         time_limited = true;
     }
     return true;
@@ -298,7 +1533,7 @@ bool exception_setup(bool limit_time)
 void exception_cancel()
 {
     if (time_limited) {
-        alarm(0);
+        op_timer_stop();
         time_limited = false;
     }
 
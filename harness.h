@@ -8,22 +8,125 @@
 /* This test harness enables us to do stringent testing of code.
  * It overloads the library versions of malloc and free with ones that
  * allow checking for common allocation errors.
+ * The functions below may be called from several threads at once.
  */
 
 void *test_malloc(size_t size);
 void *test_calloc(size_t nmemb, size_t size);
 void test_free(void *p);
 char *test_strdup(const char *s);
-/* FIXME: provide test_realloc as well */
+void *test_realloc(void *p, size_t size);
+
+/* Arena allocation.
+ * Blocks carved from an arena are checked like any other block and may be
+ * released one at a time with test_free, but test_arena_free gives back all
+ * of them at once, in time proportional to the number of chunks the arena
+ * holds rather than the number of blocks. Small blocks released one at a
+ * time are reused by later allocations of the same size from the arena.
+ * Distinct arenas may be used from distinct threads, while a single arena
+ * must not be allocated from, merged or freed by two threads at once.
+ */
+typedef struct __arena arena_t;
+
+arena_t *test_arena_new(void);
+void *test_arena_malloc(arena_t *arena, size_t size);
+char *test_arena_strdup(arena_t *arena, const char *s);
+/* Move all blocks of src into dst, src must not be used afterwards */
+void test_arena_merge(arena_t *dst, arena_t *src);
+void test_arena_free(arena_t *arena);
 
 #ifdef INTERNAL
 
 /* Report number of allocated blocks */
 size_t allocation_check();
 
+/* Report number of blocks still in use when their arena was released,
+ * summed over all arenas released so far
+ */
+size_t arena_bulk_check();
+
+/* Allocation statistics, kept from the last reset.
+ * Size class k counts allocations of [2^(k-1), 2^k) bytes, the last class
+ * any larger one.
+ */
+#define ALLOC_SIZE_CLASSES 32
+
+typedef struct {
+    size_t live_bytes; /* Payload bytes currently allocated */
+    size_t peak_bytes; /* Highest value of live_bytes */
+    size_t allocs;
+    size_t size_classes[ALLOC_SIZE_CLASSES];
+} alloc_stats_t;
+
+void allocation_stats(alloc_stats_t *stats);
+
+/* Start over, from the bytes currently allocated */
+void allocation_stats_reset();
+
 /* Probability of malloc failing, expressed as percent */
 extern int fail_probability;
 
+/* Seed the random failures, which do not draw from rand() or random() */
+void fail_injection_seed(unsigned int seed);
+
+/* Deterministic failures, on top of random ones.
+ * Allocation attempts are counted from the start, or the last call to
+ * fail_injection_reset. The fail_nth one fails, as does every fail_every one
+ * and any attempt made from the code address fail_site. Zero or NULL disables
+ * each of them.
+ */
+extern int fail_nth, fail_every;
+extern void *fail_site;
+
+void fail_injection_reset();
+
+/* Report number of allocation attempts since the last reset, and through site
+ * the caller of the fail_nth one, if it was reached
+ */
+size_t allocation_attempts(void **site);
+
+/* Fast mode trades checks for speed: blocks are neither filled nor poisoned,
+ * and they are registered in a compact table indexed from their header
+ * rather than in the hash set used otherwise. Freeing a block twice or one
+ * that was never allocated is still reported.
+ */
+extern int fast_mode;
+
+/* Record the call site of every allocation, to be reported by
+ * allocation_profile
+ */
+extern int profile_mode;
+
+/* Place one in every guard_rate blocks, none when 0, at the end of its own
+ * mapping followed by an inaccessible page, so that overflowing it faults
+ * right away instead of being noticed when freeing it. Every such block takes
+ * at least two pages, hence sampling for large queues.
+ */
+extern int guard_rate;
+
+/* Keep up to quarantine_size freed blocks, poisoned, away from reuse.
+ * Blocks written to while in quarantine are reported as they leave it, on
+ * their way back to the C library.
+ */
+extern int quarantine_size;
+
+/* Release all quarantined blocks, checking them */
+void quarantine_flush();
+
+/* Statistics of allocations made from one call site.
+ * Live counts leave out blocks carved from arenas.
+ */
+typedef struct {
+    void *site; /* Return address of the allocation call */
+    size_t allocs, bytes;
+    size_t live_blocks, live_bytes;
+} alloc_site_t;
+
+/* Store up to max call sites, sorted by decreasing number of bytes
+ * allocated, and return how many were stored
+ */
+size_t allocation_profile(alloc_site_t *sites, size_t max);
+
 /*
  * Set/unset cautious mode.
  * In this mode, makes extra sure any block to be freed is currently allocated.
@@ -39,11 +142,30 @@ void set_noallocate_mode(bool noallocate);
 /* Return whether any errors have occurred since last time checked */
 bool error_check();
 
+/* Return whether any errors have occurred at all, checked or not */
+bool error_seen();
+
+/* Time budget of operations run with a time limit, in microseconds.
+ * Running over it raises SIGALRM in the thread running the operation.
+ * 0 means no limit.
+ */
+extern int time_budget;
+
 /* Prepare for a risky operation using setjmp.
  * Function returns true for initial return, false for error return
+ * Every thread has its own exception context.
+ * With limit_time, the operation is timed and held to time_budget.
  */
 bool exception_setup(bool limit_time);
 
+/* Report time taken by the last operation run with a time limit, whether it
+ * completed or not, in microseconds
+ */
+long last_op_time();
+
+/* Report number of operations run with a time limit so far by this thread */
+size_t timed_ops();
+
 /* Call once past risky code */
 void exception_cancel();
 
@@ -57,6 +179,7 @@ void trigger_exception(char *msg);
 #define malloc test_malloc
 #define calloc test_calloc
 #define free test_free
+#define realloc test_realloc
 
 /* Use undef to avoid strdup redefined error */
 #undef strdup
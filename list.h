@@ -452,6 +452,144 @@ static inline void list_move_tail(struct list_head *node,
         safe = list_entry(safe->member.next, typeof(*entry), member))
 #endif
 
+/**
+ * LIST_PREFETCH_DISTANCE - Number of nodes the prefetching iterators run ahead
+ *
+ * A linked list offers no way to compute the address of a node further down
+ * without loading every node on the way. The *_prefetch iterators therefore
+ * keep a second cursor @ahead this many nodes in front of the loop cursor and
+ * issue a prefetch for each node it reaches, so that the miss on that node is
+ * overlapped with the work done in the loop body on the current one. It may be
+ * overridden at build time.
+ */
+#ifndef LIST_PREFETCH_DISTANCE
+#define LIST_PREFETCH_DISTANCE 4
+#elif LIST_PREFETCH_DISTANCE < 1
+#error "LIST_PREFETCH_DISTANCE must be at least 1"
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define list_prefetch(addr) __builtin_prefetch(addr)
+#else
+#define list_prefetch(addr) ((void) (addr))
+#endif
+
+/**
+ * list_prefetch_start() - Place the lookahead cursor of a prefetching iterator
+ * @head: pointer to the head of the list
+ *
+ * Walks up to LIST_PREFETCH_DISTANCE nodes from the first one, prefetching
+ * each of them, and stops early at @head for short lists.
+ *
+ * Return: the node LIST_PREFETCH_DISTANCE positions after the first one, or
+ * @head if the list is not that long
+ */
+static inline struct list_head *list_prefetch_start(struct list_head *head)
+{
+    struct list_head *ahead = head->next;
+
+    for (int i = 0; i < LIST_PREFETCH_DISTANCE && ahead != head; i++) {
+        ahead = ahead->next;
+        list_prefetch(ahead);
+    }
+    return ahead;
+}
+
+/**
+ * list_prefetch_next() - Advance the lookahead cursor by one node
+ * @ahead: current lookahead node
+ * @head: pointer to the head of the list
+ *
+ * Once @ahead reached @head it stays there.
+ *
+ * Return: the node following @ahead
+ */
+static inline struct list_head *list_prefetch_next(struct list_head *ahead,
+                                                   struct list_head *head)
+{
+    if (ahead == head)
+        return head;
+    ahead = ahead->next;
+    list_prefetch(ahead);
+    return ahead;
+}
+
+/**
+ * list_for_each_prefetch - Iterate over list nodes, prefetching ahead
+ * @node: list_head pointer used as iterator
+ * @ahead: list_head pointer used as lookahead cursor
+ * @head: pointer to the head of the list
+ *
+ * Same as list_for_each(), with nodes prefetched LIST_PREFETCH_DISTANCE
+ * positions in advance. The list must be kept unmodified while iterating.
+ */
+#define list_for_each_prefetch(node, ahead, head)                 \
+    for (node = (head)->next, ahead = list_prefetch_start(head);  \
+         node != (head);                                          \
+         node = node->next, ahead = list_prefetch_next(ahead, head))
+
+/**
+ * list_for_each_safe_prefetch - Iterate over list nodes, allowing removal of
+ *                               the current node and prefetching ahead
+ * @node: list_head pointer used as iterator
+ * @safe: list_head pointer storing the next node for safe iteration
+ * @ahead: list_head pointer used as lookahead cursor
+ * @head: pointer to the head of the list
+ *
+ * Same as list_for_each_safe(). Only @node may be removed in the loop body:
+ * removing any other node may leave @ahead dangling.
+ */
+#define list_for_each_safe_prefetch(node, safe, ahead, head)     \
+    for (node = (head)->next, safe = node->next,                 \
+        ahead = list_prefetch_start(head);                       \
+         node != (head); node = safe, safe = node->next,         \
+        ahead = list_prefetch_next(ahead, head))
+
+/**
+ * list_for_each_entry_prefetch - Iterate over a list of entries, prefetching
+ *                                ahead
+ * @entry: pointer to the structure type, used as the loop iterator
+ * @ahead: list_head pointer used as lookahead cursor
+ * @head: pointer to the head of the list
+ * @member: name of the list_head member within the structure type of @entry
+ *
+ * Same as list_for_each_entry(), with nodes prefetched LIST_PREFETCH_DISTANCE
+ * positions in advance. The list must be kept unmodified while iterating.
+ */
+#if __LIST_HAVE_TYPEOF
+#define list_for_each_entry_prefetch(entry, ahead, head, member)         \
+    for (entry = list_entry((head)->next, typeof(*entry), member),       \
+        ahead = list_prefetch_start(head);                               \
+         &entry->member != (head);                                       \
+         entry = list_entry(entry->member.next, typeof(*entry), member), \
+        ahead = list_prefetch_next(ahead, head))
+
+/**
+ * list_for_each_entry_prefetch_field - Iterate over a list of entries,
+ *                                      prefetching nodes and their payload
+ * @entry: pointer to the structure type, used as the loop iterator
+ * @ahead: list_head pointer used as lookahead cursor
+ * @head: pointer to the head of the list
+ * @member: name of the list_head member within the structure type of @entry
+ * @field: name of a pointer member of @entry whose target is prefetched too
+ *
+ * Like list_for_each_entry_prefetch(). In addition, @field is read from the
+ * entry the lookahead cursor leaves, whose cache line was just needed to
+ * advance the cursor, and the memory it points to is prefetched. This suits
+ * entries holding a separately allocated payload such as a string.
+ */
+#define list_for_each_entry_prefetch_field(entry, ahead, head, member, field) \
+    for (entry = list_entry((head)->next, typeof(*entry), member),            \
+        ahead = list_prefetch_start(head);                                    \
+         &entry->member != (head);                                            \
+         entry = list_entry(entry->member.next, typeof(*entry), member),      \
+        ahead = ((ahead) != (head)                                            \
+                     ? list_prefetch(                                         \
+                           list_entry(ahead, typeof(*entry), member)->field)  \
+                     : (void) 0,                                              \
+        list_prefetch_next(ahead, head)))
+#endif
+
 #undef __LIST_HAVE_TYPEOF
 
 #ifdef __cplusplus
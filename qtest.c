@@ -1,10 +1,16 @@
 /* Implementation of testing code for queue code */
 
+#define _GNU_SOURCE /* dladdr */
+
 #include <assert.h>
+#include <dlfcn.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <signal.h>
 #include <spawn.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -54,7 +60,6 @@ extern void q_shuffle(struct list_head *head);
 
 /* How large is a queue before it's considered big.
  * This affects how it gets printed
- * and whether cautious mode is used when freeing the queue
  */
 #define BIG_LIST_SIZE 30
 
@@ -76,6 +81,9 @@ static int string_length = MAXSTRING;
 
 static int descend = 0;
 
+/* Whether new queues are backed by an arena */
+static int use_arena = 0;
+
 #define MIN_RANDSTR_LEN 5
 #define MAX_RANDSTR_LEN 10
 static const char charset[] = "abcdefghijklmnopqrstuvwxyz";
@@ -87,6 +95,25 @@ typedef enum {
 /* Forward declarations */
 static bool q_show(int vlevel);
 
+/* Free queue q holding size elements, reporting blocks leaked in its arena.
+ * Each element takes two blocks, its own and that of its string, so an arena
+ * released with more blocks in use held some the queue no longer reached.
+ * Elements of a queue mixing heap and arena ones are all freed one at a time,
+ * hence leaks there only show once they outnumber those blocks.
+ */
+static bool queue_free(struct list_head *q, size_t size)
+{
+    size_t bulk = arena_bulk_check();
+    q_free(q);
+    bulk = arena_bulk_check() - bulk;
+    if (bulk <= 2 * size)
+        return true;
+
+    report(1, "ERROR: Freed queue, but %lu blocks of its arena were leaked",
+           bulk - 2 * size);
+    return false;
+}
+
 static bool do_free(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -102,9 +129,6 @@ static bool do_free(int argc, char *argv[])
     }
     error_check();
 
-    if (current && current->size > BIG_LIST_SIZE)
-        set_cautious_mode(false);
-
     struct list_head *qnext = NULL;
     if (chain.size > 1) {
         qnext = (current->chain.next == &chain.head) ? chain.head.next
@@ -115,9 +139,8 @@ static bool do_free(int argc, char *argv[])
         list_del(&current->chain);
 
         if (exception_setup(true))
-            q_free(current->q);
+            ok = queue_free(current->q, current->size);
         exception_cancel();
-        set_cautious_mode(true);
     }
 
     if (current) {
@@ -148,17 +171,31 @@ static bool do_new(int argc, char *argv[])
 
     bool ok = true;
 
-    if (exception_setup(true)) {
-        queue_contex_t *qctx = malloc(sizeof(queue_contex_t));
-        list_add_tail(&qctx->chain, &chain.head);
+    struct list_head *q = NULL;
+    if (exception_setup(true))
+        q = use_arena ? q_new_arena() : q_new();
+    exception_cancel();
 
+    /* A queue that could not be created is left out of the chain, where merge
+     * would come across it
+     */
+    if (q) {
+        queue_contex_t *qctx = malloc_or_fail(sizeof(queue_contex_t), "new");
+        list_add_tail(&qctx->chain, &chain.head);
         qctx->size = 0;
-        qctx->q = q_new();
+        qctx->q = q;
         qctx->id = chain.size++;
-
         current = qctx;
+    } else {
+        fail_count++;
+        if (fail_count < fail_limit) {
+            report(2, "Creating a queue failed");
+        } else {
+            report(1, "ERROR: Creating a queue failed (%d failures total)",
+                   fail_count);
+            ok = false;
+        }
     }
-    exception_cancel();
     q_show(3);
 
     return ok && !error_check();
@@ -694,6 +731,182 @@ static bool do_dm(int argc, char *argv[])
     return ok && !error_check();
 }
 
+/* Walk the queue from the nearer end to find the node at position index */
+static struct list_head *q_walk(int index)
+{
+    struct list_head *cur = current->q;
+    if (index < current->size / 2) {
+        for (int i = 0; i <= index; i++)
+            cur = cur->next;
+    } else {
+        for (int i = current->size; i > index; i--)
+            cur = cur->prev;
+    }
+    return cur;
+}
+
+/* Checking a positional operation against q_walk takes O(n), which would hide
+ * the O(log n) cost of the operation itself. Hence positions far from both
+ * ends are only checked on one call out of WALK_SAMPLE.
+ */
+#define WALK_SAMPLE 64
+
+static bool walk_sampled(int index)
+{
+    static unsigned int walk_calls = 0;
+    int nearer = index < current->size / 2 ? index : current->size - index;
+    return nearer < WALK_SAMPLE || ++walk_calls % WALK_SAMPLE == 0;
+}
+
+static bool do_get(int argc, char *argv[])
+{
+    if (argc != 2) {
+        report(1, "%s needs 1 argument", argv[0]);
+        return false;
+    }
+
+    int index;
+    if (!get_int(argv[1], &index)) {
+        report(1, "Invalid index '%s'", argv[1]);
+        return false;
+    }
+
+    if (!current || !current->q) {
+        report(3, "Warning: Try to access null queue");
+        return false;
+    }
+    error_check();
+
+    element_t *e = NULL;
+    if (exception_setup(true))
+        e = q_get(current->q, index);
+    exception_cancel();
+
+    bool ok = true;
+    if (index < 0 || index >= current->size) {
+        if (e)
+            report(1, "ERROR: Got an element at out of range index %d", index);
+        else
+            report(1, "Index %d is out of range", index);
+        ok = false;
+    } else if (!e) {
+        fail_count++;
+        if (fail_count < fail_limit) {
+            report(2, "Getting element %d failed", index);
+        } else {
+            report(1, "ERROR: Getting element %d failed (%d failures total)",
+                   index, fail_count);
+            ok = false;
+        }
+    } else if (walk_sampled(index) && &e->list != q_walk(index)) {
+        report(1, "ERROR: Got wrong element %s at index %d", e->value, index);
+        ok = false;
+    } else {
+        report(1, "q[%d] = %s", index, e->value);
+    }
+
+    return ok && !error_check();
+}
+
+static bool do_delat(int argc, char *argv[])
+{
+    if (argc != 2) {
+        report(1, "%s needs 1 argument", argv[0]);
+        return false;
+    }
+
+    int index;
+    if (!get_int(argv[1], &index)) {
+        report(1, "Invalid index '%s'", argv[1]);
+        return false;
+    }
+
+    if (!current || !current->q) {
+        report(3, "Warning: Try to access null queue");
+        return false;
+    }
+    error_check();
+
+    bool ok = false;
+    if (exception_setup(true))
+        ok = q_delete_at(current->q, index);
+    exception_cancel();
+
+    if (ok) {
+        current->size--;
+    } else if (index < 0 || index >= current->size) {
+        report(1, "Index %d is out of range", index);
+    } else {
+        fail_count++;
+        if (fail_count < fail_limit) {
+            ok = true;
+            report(2, "Deleting element %d failed", index);
+        } else {
+            report(1, "ERROR: Deleting element %d failed (%d failures total)",
+                   index, fail_count);
+        }
+    }
+
+    q_show(3);
+    return ok && !error_check();
+}
+
+static bool do_insat(int argc, char *argv[])
+{
+    if (argc != 3) {
+        report(1, "%s needs 2 arguments", argv[0]);
+        return false;
+    }
+
+    int index;
+    if (!get_int(argv[1], &index)) {
+        report(1, "Invalid index '%s'", argv[1]);
+        return false;
+    }
+
+    if (!current || !current->q) {
+        report(3, "Warning: Try to access null queue");
+        return false;
+    }
+    error_check();
+
+    bool ok = false;
+    if (exception_setup(true))
+        ok = q_insert_at(current->q, index, argv[2]);
+    exception_cancel();
+
+    if (ok) {
+        current->size++;
+        element_t *e = NULL;
+        if (walk_sampled(index))
+            e = list_entry(q_walk(index), element_t, list);
+        if (e && strcmp(e->value, argv[2])) {
+            report(1, "ERROR: Inserted %s is not found at index %d", argv[2],
+                   index);
+            ok = false;
+        } else if (e && e->value == argv[2]) {
+            report(1,
+                   "ERROR: Need to allocate and copy string for new queue "
+                   "element");
+            ok = false;
+        }
+    } else if (index < 0 || index > current->size) {
+        report(1, "Index %d is out of range", index);
+    } else {
+        fail_count++;
+        if (fail_count < fail_limit) {
+            ok = true;
+            report(2, "Insertion of %s failed", argv[2]);
+        } else {
+            report(1, "ERROR: Insertion of %s failed (%d failures total)",
+                   argv[2], fail_count);
+        }
+    }
+
+    q_show(3);
+    return ok && !error_check();
+}
+
 static bool do_swap(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -862,6 +1075,7 @@ static bool do_merge(int argc, char *argv[])
     exception_cancel();
     set_noallocate_mode(false);
 
+    bool ok = true;
     if (q_size(&chain.head) > 1) {
         chain.size = 1;
         current = list_entry(chain.head.next, queue_contex_t, chain);
@@ -871,7 +1085,8 @@ static bool do_merge(int argc, char *argv[])
         while ((uintptr_t) cur != (uintptr_t) &chain.head) {
             queue_contex_t *ctx = list_entry(cur, queue_contex_t, chain);
             cur = cur->next;
-            q_free(ctx->q);
+            if (!queue_free(ctx->q, ctx->size))
+                ok = false;
             free(ctx);
         }
 
@@ -879,7 +1094,6 @@ static bool do_merge(int argc, char *argv[])
         current->chain.next = &chain.head;
     }
 
-    bool ok = true;
     if (current && current->size) {
         for (struct list_head *cur_l = current->q->next;
              cur_l != current->q && --len; cur_l = cur_l->next) {
@@ -1074,6 +1288,228 @@ static bool do_shuffle(int argc, char *argv[])
     return !error_check();
 }
 
+/* How many call sites memprof reports at most */
+#define MEMPROF_SITES 64
+
+/* Describe a code address as symbol+offset, followed by its offset within
+ * the executable for addr2line
+ */
+static void site_name(void *site, char *buf, size_t size)
+{
+    Dl_info info;
+    if (!dladdr(site, &info)) {
+        snprintf(buf, size, "%p", site);
+        return;
+    }
+
+    const char *file = strrchr(info.dli_fname, '/');
+    file = file ? file + 1 : info.dli_fname;
+    size_t offset = (uintptr_t) site - (uintptr_t) info.dli_fbase;
+    if (info.dli_sname)
+        snprintf(buf, size, "%s+%#lx (%s+%#lx)", info.dli_sname,
+                 (uintptr_t) site - (uintptr_t) info.dli_saddr, file, offset);
+    else
+        snprintf(buf, size, "%s+%#lx", file, offset);
+}
+
+static bool do_memprof(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+
+    if (!profile_mode)
+        report(1, "Warning: Allocations are only profiled after 'option "
+                  "profile 1'");
+
+    alloc_site_t sites[MEMPROF_SITES];
+    size_t n = allocation_profile(sites, MEMPROF_SITES);
+    report(1, "%10s %12s %10s %12s  %s", "allocs", "bytes", "live",
+           "live bytes", "call site");
+    for (size_t i = 0; i < n; i++) {
+        char name[256];
+        site_name(sites[i].site, name, sizeof(name));
+        report(1, "%10lu %12lu %10lu %12lu  %s", sites[i].allocs,
+               sites[i].bytes, sites[i].live_blocks, sites[i].live_bytes,
+               name);
+    }
+    return true;
+}
+
+/* Resize a block through test_realloc to each size in turn, checking that its
+ * contents survive whether it moves or not, then free it. The block is carved
+ * from an arena with 'option arena 1'. Failed attempts, as injected with
+ * 'option failnth', must leave the block as it was.
+ */
+static bool do_realloc(int argc, char *argv[])
+{
+    if (argc < 2) {
+        report(1, "%s needs at least one size", argv[0]);
+        return false;
+    }
+
+    arena_t *arena = use_arena ? test_arena_new() : NULL;
+    unsigned char *block = NULL;
+    int size = 0;
+    bool ok = true;
+    error_check();
+
+    if (exception_setup(true)) {
+        for (int i = 1; ok && i < argc; i++) {
+            int new_size;
+            if (!get_int(argv[i], &new_size) || new_size <= 0) {
+                report(1, "Invalid size '%s'", argv[i]);
+                ok = false;
+                break;
+            }
+
+            unsigned char *resized = !block && arena
+                                         ? test_arena_malloc(arena, new_size)
+                                         : test_realloc(block, new_size);
+            if (resized) {
+                report(2, "%d bytes: %s", new_size,
+                       !block             ? "allocated"
+                       : resized == block ? "resized in place"
+                                          : "moved");
+                block = resized;
+            } else {
+                report(2, "%d bytes: failed", new_size);
+            }
+
+            /* Byte j holds j, up to the size the block had and has now */
+            int kept = resized && new_size < size ? new_size : size;
+            for (int j = 0; j < kept; j++) {
+                if (block[j] != (unsigned char) j) {
+                    report(1, "ERROR: Byte %d lost by resizing", j);
+                    ok = false;
+                    break;
+                }
+            }
+            if (resized) {
+                for (int j = kept; j < new_size; j++)
+                    block[j] = j;
+                size = new_size;
+            }
+        }
+    }
+    exception_cancel();
+
+    test_free(block);
+    test_arena_free(arena);
+    return ok && !error_check();
+}
+
+/* Blocks passed between the threads of do_threads. Each thread puts the
+ * blocks it allocates in random slots and frees whatever it takes out, so
+ * that most blocks are freed by another thread than the one allocating them.
+ */
+#define THREAD_SLOTS 256
+#define THREADS_MAX 64
+
+static unsigned char *_Atomic thread_slots[THREAD_SLOTS];
+static atomic_bool thread_fill_lost;
+
+typedef struct {
+    pthread_t thread;
+    int count;
+    unsigned int seed;
+} alloc_thread_t;
+
+/* Blocks are filled with their size, modulo 256, checked before freeing */
+static void thread_release(unsigned char *block)
+{
+    if (!block)
+        return;
+    size_t size = block[0] + 1;
+    for (size_t i = 1; i < size; i++) {
+        if (block[i] != block[0])
+            atomic_store(&thread_fill_lost, true);
+    }
+    test_free(block);
+}
+
+static void *alloc_thread(void *arg)
+{
+    alloc_thread_t *t = arg;
+    for (int i = 0; i < t->count; i++) {
+        size_t size = 1 + rand_r(&t->seed) % 256;
+        unsigned char *block = test_malloc(size);
+        if (block)
+            memset(block, size - 1, size);
+        int slot = rand_r(&t->seed) % THREAD_SLOTS;
+        thread_release(atomic_exchange(&thread_slots[slot], block));
+    }
+    return NULL;
+}
+
+static bool do_threads(int argc, char *argv[])
+{
+    int threads, count;
+    if (argc != 3 || !get_int(argv[1], &threads) || threads < 1 ||
+        threads > THREADS_MAX || !get_int(argv[2], &count) || count < 0) {
+        report(1, "%s needs a number of threads, up to %d, and a count",
+               argv[0], THREADS_MAX);
+        return false;
+    }
+
+    size_t allocated = allocation_check();
+    alloc_thread_t work[THREADS_MAX];
+    bool ok = true;
+    int started;
+    for (started = 0; started < threads; started++) {
+        work[started].count = count;
+        work[started].seed = started + 1;
+        if (pthread_create(&work[started].thread, NULL, alloc_thread,
+                           &work[started])) {
+            report(1, "Could not start thread %d", started);
+            ok = false;
+            break;
+        }
+    }
+    for (int i = 0; i < started; i++)
+        pthread_join(work[i].thread, NULL);
+    for (int i = 0; i < THREAD_SLOTS; i++)
+        thread_release(atomic_exchange(&thread_slots[i], NULL));
+
+    if (atomic_exchange(&thread_fill_lost, false)) {
+        report(1, "ERROR: Blocks were changed while passed between threads");
+        ok = false;
+    }
+    if (allocation_check() != allocated) {
+        report(1, "ERROR: %lu blocks allocated by threads were not freed",
+               allocation_check() - allocated);
+        ok = false;
+    }
+    return ok && !error_check();
+}
+
+/* Count allocations anew for failnth and failevery */
+static void set_fail_count(int oldval)
+{
+    fail_injection_reset();
+}
+
+/* Offset within the executable of the call site to fail, as memprof shows */
+static int fail_site_offset = 0;
+
+static void set_fail_site(int oldval)
+{
+    Dl_info info;
+    if (fail_site_offset && dladdr((void *) set_fail_site, &info))
+        fail_site = (char *) info.dli_fbase + fail_site_offset;
+    else
+        fail_site = NULL;
+}
+
+static int seed = 0;
+
+static void set_seed(int oldval)
+{
+    srand(seed);
+    fail_injection_seed(seed);
+}
+
 static void console_init()
 {
     ADD_COMMAND(new, "Create new queue", "");
@@ -1115,6 +1551,17 @@ static void console_init()
     ADD_COMMAND(reverseK, "Reverse the nodes of the queue 'K' at a time",
                 "[K]");
     ADD_COMMAND(shuffle, "shuffle the queue randomly", "");
+    ADD_COMMAND(get, "Show the element at position idx of queue", "idx");
+    ADD_COMMAND(delat, "Delete the element at position idx of queue", "idx");
+    ADD_COMMAND(insat, "Insert string str at position idx of queue",
+                "idx str");
+    ADD_COMMAND(memprof, "Show allocations per call site, by bytes", "");
+    ADD_COMMAND(realloc,
+                "Resize a block to each size in turn, checking its contents",
+                "size ...");
+    ADD_COMMAND(threads,
+                "Allocate and free n blocks from each of t threads at once",
+                "t n");
     add_param("length", &string_length, "Maximum length of displayed string",
               NULL);
     add_param("malloc", &fail_probability, "Malloc failure probability percent",
@@ -1123,6 +1570,31 @@ static void console_init()
               "Number of times allow queue operations to return false", NULL);
     add_param("descend", &descend,
               "Sort and merge queue in ascending/descending order", NULL);
+    add_param("arena", &use_arena,
+              "Back new queues with an arena freeing elements in bulk", NULL);
+    add_param("failnth", &fail_nth,
+              "Fail the Nth allocation from now on (0: none)", set_fail_count);
+    add_param("failevery", &fail_every,
+              "Fail every Kth allocation from now on (0: none)",
+              set_fail_count);
+    add_param("failsite", &fail_site_offset,
+              "Fail allocations from this offset in qtest, as memprof shows",
+              set_fail_site);
+    add_param("seed", &seed, "Seed random strings and malloc failures",
+              set_seed);
+    add_param("fast", &fast_mode,
+              "Skip filling blocks, registering them compactly (perf traces)",
+              NULL);
+    add_param("profile", &profile_mode,
+              "Record the call site of allocations, see memprof", NULL);
+    add_param("quarantine", &quarantine_size,
+              "Number of freed blocks kept poisoned to catch use after free",
+              NULL);
+    add_param("guard", &guard_rate,
+              "Put one in N blocks before an inaccessible page (0: none)",
+              NULL);
+    add_param("timelimit", &time_budget,
+              "Time budget of each operation in microseconds (0: none)", NULL);
 }
 
 /* Signal handlers */
@@ -1152,25 +1624,35 @@ static void q_init()
     signal(SIGALRM, sigalrm_handler);
 }
 
+/* Elements of the current queue, for time -n */
+static size_t queue_elements()
+{
+    return current ? current->size : 0;
+}
+
 static bool q_quit(int argc, char *argv[])
 {
     report(3, "Freeing queue");
-    if (current && current->size > BIG_LIST_SIZE)
-        set_cautious_mode(false);
-
+    volatile bool ok = true;
     if (exception_setup(true)) {
         struct list_head *cur = chain.head.next;
         while (chain.size > 0) {
             queue_contex_t *qctx = list_entry(cur, queue_contex_t, chain);
             cur = cur->next;
-            q_free(qctx->q);
+            if (!queue_free(qctx->q, qctx->size))
+                ok = false;
             free(qctx);
             chain.size--;
         }
+        current = NULL;
     }
 
     exception_cancel();
-    set_cautious_mode(true);
+
+    /* Check blocks freed last for use after free */
+    quarantine_flush();
+    if (error_check() || !ok)
+        return false;
 
     size_t bcnt = allocation_check();
     if (bcnt > 0) {
@@ -1182,16 +1664,148 @@ static bool q_quit(int argc, char *argv[])
     return true;
 }
 
+/* Sweep mode replays a trace in a child process for each allocation it makes,
+ * failing that allocation alone. Children run with the same seed, so they all
+ * see the same allocations up to the one made to fail.
+ * Commands are expected to fail once an allocation has, and later ones to
+ * miss what it would have made, so the exit status of children tells
+ * nothing. Only crashes, errors caught by the harness and blocks still
+ * allocated after quitting are reported.
+ * Every child replays the whole trace, so the sweep takes time quadratic in
+ * the length of the trace. Beyond SWEEP_MAX_RUNS allocations, the trace is
+ * cut into that many windows of consecutive allocations, and one allocation
+ * picked at random within each window is failed.
+ */
+#define SWEEP_SEED 1
+#define SWEEP_MAX_RUNS 200
+
 static void usage(char *cmd)
 {
-    printf("Usage: %s [-h] [-f IFILE][-v VLEVEL][-l LFILE]\n", cmd);
+    printf("Usage: %s [-h] [-s] [-f IFILE][-v VLEVEL][-l LFILE][-j JFILE]\n",
+           cmd);
+    printf("       %s --compile IFILE -o OFILE\n", cmd);
     printf("\t-h         Print this information\n");
-    printf("\t-f IFILE   Read commands from IFILE\n");
+    printf("\t-s         Replay IFILE failing each allocation in turn, or\n");
+    printf("\t           %d of them spread over longer traces\n",
+           SWEEP_MAX_RUNS);
+    printf("\t-f IFILE   Read commands from IFILE, plain or compiled\n");
+    printf("\t--compile IFILE -o OFILE\n");
+    printf("\t           Compile the commands of IFILE into OFILE\n");
     printf("\t-v VLEVEL  Set verbosity level\n");
     printf("\t-l LFILE   Echo results to LFILE\n");
+    printf("\t-j JFILE   Write a JSON record of each command to JFILE\n");
     exit(0);
 }
 
+/* Pipe to the parent, in a child of the sweep */
+static int sweep_fd = -1;
+
+typedef struct {
+    bool finished; /* Whether the child got to the end of the trace */
+    size_t attempts;
+    void *site;    /* Where the failed allocation was made */
+    bool errors;   /* Whether the harness caught any error */
+    size_t leaked; /* Blocks left allocated after quitting */
+} sweep_report_t;
+
+/* Run the trace in a child failing allocation n, 0 for none, and return its
+ * exit status. Return in the child itself, with *child set.
+ */
+static int sweep_run(int n, sweep_report_t *report, bool *child)
+{
+    int fds[2];
+    if (pipe(fds)) {
+        perror("pipe");
+        exit(EXIT_FAILURE);
+    }
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    }
+    if (!pid) {
+        close(fds[0]);
+        sweep_fd = fds[1];
+        fail_nth = n;
+        srand(SWEEP_SEED);
+        fail_injection_seed(SWEEP_SEED);
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd >= 0) {
+            dup2(null_fd, STDOUT_FILENO);
+            close(null_fd);
+        }
+        *child = true;
+        return 0;
+    }
+
+    close(fds[1]);
+    /* A child that crashed has nothing to tell */
+    if (read(fds[0], report, sizeof(*report)) != sizeof(*report))
+        memset(report, 0, sizeof(*report));
+    close(fds[0]);
+
+    int status;
+    waitpid(pid, &status, 0);
+    return status;
+}
+
+/* Only returns in children, which go on running the trace */
+static void sweep_allocations()
+{
+    sweep_report_t report;
+    bool child = false;
+    int status = sweep_run(0, &report, &child);
+    if (child)
+        return;
+    if (!report.finished || !WIFEXITED(status) || WEXITSTATUS(status) ||
+        report.errors || report.leaked) {
+        printf("Trace fails without failing any allocation\n");
+        exit(EXIT_FAILURE);
+    }
+
+    size_t total = report.attempts;
+    size_t window = (total + SWEEP_MAX_RUNS - 1) / SWEEP_MAX_RUNS;
+    size_t runs = 0;
+    int errors = 0;
+    srand(SWEEP_SEED);
+    for (size_t first = 1; first <= total; first += window) {
+        size_t n = first + (window > 1 ? (size_t) rand() % window : 0);
+        if (n > total)
+            n = total;
+        runs++;
+        status = sweep_run(n, &report, &child);
+        if (child)
+            return;
+        if (report.finished && !report.errors && !report.leaked)
+            continue;
+
+        char name[256] = "unknown call site";
+        if (report.site)
+            site_name(report.site, name, sizeof(name));
+        printf("Failing allocation %lu from %s: ", n, name);
+        if (WIFSIGNALED(status))
+            printf("killed by signal %d\n", WTERMSIG(status));
+        else if (!report.finished)
+            printf("exited before the end of the trace\n");
+        else if (report.errors)
+            printf("error caught by the harness\n");
+        else
+            printf("%lu blocks leaked\n", report.leaked);
+        errors++;
+    }
+
+    if (runs == total)
+        printf("Failed each of %lu allocations in turn, %d exposed errors\n",
+               total, errors);
+    else
+        printf("Failed %lu of %lu allocations, %d exposed errors\n", runs,
+               total, errors);
+    printf("Add 'option failnth N' before the first command to replay one\n");
+    exit(errors ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
 extern char **environ;
 
 /* Returns true if the hash is exactly 40 hexadecimal characters. */
@@ -1399,13 +2013,24 @@ int main(int argc, char *argv[])
     char lbuf[BUFSIZE];
     char *logfile_name = NULL;
     int level = 4;
+    bool sweep = false;
+    char *compile_name = NULL, *outfile_name = NULL;
+    char *json_name = NULL;
     int c;
 
-    while ((c = getopt(argc, argv, "hv:f:l:")) != -1) {
+    static struct option long_options[] = {
+        {"compile", required_argument, NULL, 'c'},
+        {NULL, 0, NULL, 0},
+    };
+    while ((c = getopt_long(argc, argv, "hsv:f:l:o:j:", long_options, NULL)) !=
+           -1) {
         switch (c) {
         case 'h':
             usage(argv[0]);
             break;
+        case 's':
+            sweep = true;
+            break;
         case 'f':
             strncpy(buf, optarg, BUFSIZE);
             buf[BUFSIZE - 1] = '\0';
@@ -1426,6 +2051,15 @@ int main(int argc, char *argv[])
             buf[BUFSIZE - 1] = '\0';
             logfile_name = lbuf;
             break;
+        case 'c':
+            compile_name = optarg;
+            break;
+        case 'o':
+            outfile_name = optarg;
+            break;
+        case 'j':
+            json_name = optarg;
+            break;
         default:
             printf("Unknown option '%c'\n", c);
             usage(argv[0]);
@@ -1436,12 +2070,31 @@ int main(int argc, char *argv[])
     /* A better seed can be obtained by combining getpid() and its parent ID
      * with the Unix time.
      */
-    srand(os_random(getpid() ^ getppid()));
+    unsigned int start_seed = os_random(getpid() ^ getppid());
+    srand(start_seed);
+    fail_injection_seed(start_seed);
+
+    if (sweep) {
+        if (!infile_name) {
+            fprintf(stderr, "Sweep mode needs a trace given with -f\n");
+            exit(EXIT_FAILURE);
+        }
+        sweep_allocations();
+    }
 
     q_init();
     init_cmd();
     console_init();
 
+    if (compile_name) {
+        if (!outfile_name) {
+            fprintf(stderr, "Compiling needs an output file given with -o\n");
+            exit(EXIT_FAILURE);
+        }
+        set_verblevel(level);
+        return !compile_trace(compile_name, outfile_name);
+    }
+
     /* Initialize linenoise only when infile_name not exist */
     if (!infile_name) {
         /* Trigger call back function(auto completion) */
@@ -1456,8 +2109,13 @@ int main(int argc, char *argv[])
         set_echo(true);
     if (logfile_name)
         set_logfile(logfile_name);
+    if (json_name && !set_json_file(json_name)) {
+        fprintf(stderr, "Cannot write JSON records to '%s'\n", json_name);
+        exit(EXIT_FAILURE);
+    }
 
     add_quit_helper(q_quit);
+    set_element_counter(queue_elements);
 
     bool ok = true;
     ok = ok && run_console(infile_name);
@@ -1465,5 +2123,18 @@ int main(int argc, char *argv[])
     /* Do finish_cmd() before check whether ok is true or false */
     ok = finish_cmd() && ok;
 
+    if (sweep_fd >= 0) {
+        /* Commands stopped by the error limit leave the queues to free */
+        if (chain.size)
+            q_quit(0, NULL);
+        sweep_report_t report;
+        report.finished = true;
+        report.attempts = allocation_attempts(&report.site);
+        report.errors = error_seen();
+        report.leaked = allocation_check();
+        if (write(sweep_fd, &report, sizeof(report)) != sizeof(report))
+            ok = false;
+    }
+
     return !ok;
 }
@@ -39,18 +39,266 @@
         }                                                                      \
     }
 
+/* Order-statistic index of a queue.
+ *
+ * The index is an implicit treap: the in-order sequence of its nodes mirrors
+ * the list, and every node carries the size of its subtree so that the node at
+ * a given position is found by descending from the root. All nodes live in a
+ * single pool owned by the queue, which keeps the harness block count low and
+ * lets the index be dropped with one free.
+ */
+typedef struct __rank_node {
+    struct __rank_node *left, *right;
+    struct list_head *list;
+    int size;
+    int prio;
+} rank_node_t;
+
+/* Queue header handed out by q_new().
+ * The list head must stay in the first position: callers only see &q->head.
+ */
+typedef struct {
+    struct list_head head;
+    rank_node_t *root;
+    rank_node_t *pool;  /* Storage of all index nodes */
+    rank_node_t *spare; /* Released nodes, chained through @left */
+    int pool_size;
+    int pool_used;
+    bool indexed;   /* Cleared whenever the list changes behind the index */
+    arena_t *arena; /* Where elements come from, NULL for the heap */
+    bool mixed;     /* Elements from the heap were merged into an arena queue */
+} queue_t;
+
+static inline queue_t *to_queue(struct list_head *head)
+{
+    return list_entry(head, queue_t, head);
+}
+
+/* Every operation rearranging the list without going through the index must
+ * call this. The index is rebuilt lazily by the next positional operation.
+ */
+static inline void index_invalidate(struct list_head *head)
+{
+    to_queue(head)->indexed = false;
+}
+
+static inline int rank_size(const rank_node_t *t)
+{
+    return t ? t->size : 0;
+}
+
+static inline void rank_update(rank_node_t *t)
+{
+    t->size = rank_size(t->left) + rank_size(t->right) + 1;
+}
+
+/* Split @t into its first @k nodes (@l) and the remaining ones (@r) */
+static void rank_split(rank_node_t *t,
+                       int k,
+                       rank_node_t **l,
+                       rank_node_t **r)
+{
+    if (!t) {
+        *l = *r = NULL;
+        return;
+    }
+    if (rank_size(t->left) < k) {
+        rank_split(t->right, k - rank_size(t->left) - 1, &t->right, r);
+        *l = t;
+    } else {
+        rank_split(t->left, k, l, &t->left);
+        *r = t;
+    }
+    rank_update(t);
+}
+
+/* Concatenate @l and @r, every node of @l precedes every node of @r */
+static rank_node_t *rank_merge(rank_node_t *l, rank_node_t *r)
+{
+    if (!l || !r)
+        return l ? l : r;
+    if (l->prio > r->prio) {
+        l->right = rank_merge(l->right, r);
+        rank_update(l);
+        return l;
+    }
+    r->left = rank_merge(l, r->left);
+    rank_update(r);
+    return r;
+}
+
+/* Find the node at position @k, NULL if out of range */
+static rank_node_t *rank_find(rank_node_t *t, int k)
+{
+    while (t) {
+        int left = rank_size(t->left);
+        if (k == left)
+            return t;
+        if (k < left) {
+            t = t->left;
+        } else {
+            k -= left + 1;
+            t = t->right;
+        }
+    }
+    return NULL;
+}
+
+/* Link nodes[lo, hi) into a perfectly balanced tree, then sift the random
+ * priorities down so that the heap order of the treap holds as well. Swapping
+ * priorities keeps the in-order sequence, hence the whole build is O(n).
+ */
+static rank_node_t *rank_link(rank_node_t *nodes, int lo, int hi)
+{
+    if (lo >= hi)
+        return NULL;
+
+    int mid = lo + ((hi - lo) >> 1);
+    rank_node_t *node = &nodes[mid];
+    node->left = rank_link(nodes, lo, mid);
+    node->right = rank_link(nodes, mid + 1, hi);
+    node->size = hi - lo;
+
+    for (rank_node_t *t = node;;) {
+        rank_node_t *child = t->left;
+        if (t->right && (!child || t->right->prio > child->prio))
+            child = t->right;
+        if (!child || child->prio <= t->prio)
+            break;
+        int prio = t->prio;
+        t->prio = child->prio;
+        child->prio = prio;
+        t = child;
+    }
+    return node;
+}
+
+/* Make sure the index reflects the list, rebuilding it in O(n) if needed.
+ * Spare room is reserved so a run of insertions does not regrow the pool.
+ */
+static bool index_build(queue_t *q)
+{
+    if (q->indexed)
+        return true;
+
+    free(q->pool);
+    q->pool = NULL;
+    q->root = NULL;
+    q->spare = NULL;
+    q->pool_size = q->pool_used = 0;
+
+    int n = q_size(&q->head);
+    int cap = n + (n >> 1) + 16;
+    q->pool = malloc(cap * sizeof(rank_node_t));
+    if (!q->pool)
+        return false;
+    q->pool_size = cap;
+
+    struct list_head *li;
+    list_for_each (li, &q->head) {
+        rank_node_t *node = &q->pool[q->pool_used++];
+        node->list = li;
+        node->prio = rand();
+    }
+    q->root = rank_link(q->pool, 0, n);
+    q->indexed = true;
+    return true;
+}
+
+/* Take the node at position @k out of the index and return its list node */
+static struct list_head *index_remove(queue_t *q, int k)
+{
+    rank_node_t **link = &q->root;
+    for (;;) {
+        rank_node_t *t = *link;
+        int left = rank_size(t->left);
+        if (k == left)
+            break;
+        t->size--;
+        if (k < left) {
+            link = &t->left;
+        } else {
+            k -= left + 1;
+            link = &t->right;
+        }
+    }
+
+    rank_node_t *m = *link;
+    *link = rank_merge(m->left, m->right);
+    m->left = q->spare;
+    q->spare = m;
+    return m->list;
+}
+
+/* Put list node @li at position @k of the index. The index is dropped when
+ * the pool is exhausted, to be regrown by the next positional operation.
+ */
+static void index_insert(queue_t *q, int k, struct list_head *li)
+{
+    rank_node_t *node = q->spare;
+    if (node) {
+        q->spare = node->left;
+    } else if (q->pool_used < q->pool_size) {
+        node = &q->pool[q->pool_used++];
+    } else {
+        q->indexed = false;
+        return;
+    }
+
+    node->left = node->right = NULL;
+    node->list = li;
+    node->size = 1;
+    node->prio = rand();
+
+    rank_node_t *l, *r;
+    rank_split(q->root, k, &l, &r);
+    q->root = rank_merge(rank_merge(l, node), r);
+}
+
 /* Create an empty queue */
 struct list_head *q_new()
 {
-    struct list_head *queue = malloc(sizeof(struct list_head));
+    queue_t *queue = malloc(sizeof(queue_t));
 
     if (!queue) {
         return NULL;
     }
 
-    INIT_LIST_HEAD(queue);
+    INIT_LIST_HEAD(&queue->head);
+    queue->root = NULL;
+    queue->pool = NULL;
+    queue->spare = NULL;
+    queue->pool_size = 0;
+    queue->pool_used = 0;
+    queue->indexed = false;
+    queue->arena = NULL;
+    queue->mixed = false;
 
-    return queue;
+    return &queue->head;
+}
+
+/* Create an empty queue backed by an arena */
+struct list_head *q_new_arena()
+{
+    struct list_head *head = q_new();
+
+    if (!head) {
+        return NULL;
+    }
+
+    to_queue(head)->arena = test_arena_new();
+    if (!to_queue(head)->arena) {
+        free(to_queue(head));
+        return NULL;
+    }
+
+    return head;
+}
+
+/* Whether the queue may hold elements that have to be freed one by one */
+static inline bool q_has_heap_elements(const queue_t *q)
+{
+    return q->arena ? q->mixed : !list_empty(&q->head);
 }
 
 /* Free all storage used by queue */
@@ -59,14 +307,43 @@ void q_free(struct list_head *head)
     if (!head) {
         return;
     }
-    struct list_head *pos, *tmp;
+    queue_t *q = to_queue(head);
+    struct list_head *pos, *tmp, *ahead;
+
+    /* When every element comes from the arena, releasing it frees them all */
+    if (q_has_heap_elements(q)) {
+        list_for_each_safe_prefetch (pos, tmp, ahead, head) {
+            /* The next node is in cache already, start fetching its string */
+            if (tmp != head)
+                list_prefetch(list_entry(tmp, element_t, list)->value);
+            free(list_entry(pos, element_t, list)->value);
+            free(list_entry(pos, element_t, list));
+        }
+    }
+
+    test_arena_free(q->arena);
+    free(q->pool);
+    free(q);
+}
+
+/* Allocate an element holding a copy of s, from the arena of q if any */
+static element_t *element_new(queue_t *q, const char *s)
+{
+    element_t *new_element =
+        q->arena ? test_arena_malloc(q->arena, sizeof(element_t))
+                 : malloc(sizeof(element_t));
 
-    list_for_each_safe (pos, tmp, head) {
-        free(list_entry(pos, element_t, list)->value);
-        free(list_entry(pos, element_t, list));
+    if (!new_element) {
+        return NULL;
     }
 
-    free(head);
+    new_element->value =
+        q->arena ? test_arena_strdup(q->arena, s) : strdup(s);
+    if (!new_element->value) {
+        free(new_element);
+        return NULL;
+    }
+    return new_element;
 }
 
 /* Insert an element at head of queue */
@@ -76,19 +353,16 @@ bool q_insert_head(struct list_head *head, char *s)
         return false;
     }
 
-    element_t *new_element = malloc(sizeof(element_t));
+    element_t *new_element = element_new(to_queue(head), s);
 
     if (!new_element) {
         return false;
     }
 
-    new_element->value = strdup(s);
-    if (!new_element->value) {
-        free(new_element);
-        return false;
-    }
-
     list_add(&(new_element->list), head);
+    /* An index already built is kept up to date, in O(log n) */
+    if (to_queue(head)->indexed)
+        index_insert(to_queue(head), 0, &new_element->list);
     /* cppcheck-suppress memleak */
     return true;
 }
@@ -96,7 +370,22 @@ bool q_insert_head(struct list_head *head, char *s)
 /* Insert an element at tail of queue */
 bool q_insert_tail(struct list_head *head, char *s)
 {
-    return q_insert_head(head->prev, s);
+    if (!head || !s) {
+        return false;
+    }
+
+    element_t *new_element = element_new(to_queue(head), s);
+
+    if (!new_element) {
+        return false;
+    }
+
+    list_add_tail(&(new_element->list), head);
+    if (to_queue(head)->indexed)
+        index_insert(to_queue(head), rank_size(to_queue(head)->root),
+                     &new_element->list);
+    /* cppcheck-suppress memleak */
+    return true;
 }
 
 /* Remove an element from head of queue */
@@ -107,6 +396,8 @@ element_t *q_remove_head(struct list_head *head, char *sp, size_t bufsize)
     }
     element_t *entry = list_entry(head->next, element_t, list);
     list_del(head->next);
+    if (to_queue(head)->indexed)
+        index_remove(to_queue(head), 0);
 
     if (sp) {
         strncpy(sp, entry->value, bufsize - 1);
@@ -124,6 +415,8 @@ element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize)
 
     element_t *entry = list_entry(head->prev, element_t, list);
     list_del(head->prev);
+    if (to_queue(head)->indexed)
+        index_remove(to_queue(head), to_queue(head)->root->size - 1);
 
     if (sp) {
         strncpy(sp, entry->value, bufsize - 1);
@@ -153,6 +446,11 @@ bool q_delete_mid(struct list_head *head)
     if (!head || list_empty(head)) {
         return false;
     }
+    /* Once the index is up to date the middle node is O(log n) away */
+    if (to_queue(head)->indexed) {
+        return q_delete_at(head, to_queue(head)->root->size / 2);
+    }
+    index_invalidate(head);
     if (head->next == head->prev) {
         free(list_entry(head->next, element_t, list)->value);
         free(list_entry(head->next, element_t, list));
@@ -181,6 +479,7 @@ bool q_delete_dup(struct list_head *head)
     if (head->next == head->prev) {
         return true;
     }
+    index_invalidate(head);
     struct list_head *pos, *pos_next;
     bool check = false;
     for (pos = head->next; pos != head;) {
@@ -220,6 +519,7 @@ void q_swap(struct list_head *head)
     if (!head || head->next == head->prev) {
         return;
     }
+    index_invalidate(head);
     struct list_head *first, *second;
     for (first = head->next, second = first->next;
          first != head && second != head;
@@ -228,52 +528,74 @@ void q_swap(struct list_head *head)
     }
 }
 
+/* Reverse the nodes of a ring, @head may be a queue header or any node.
+ * Exchanging next and prev of every node, the head included, is one streaming
+ * pass with two stores per node, rather than four for each list_move().
+ */
+static void list_reverse(struct list_head *head)
+{
+    struct list_head *node = head;
+    do {
+        struct list_head *next = node->next;
+        node->next = node->prev;
+        node->prev = next;
+        node = next;
+    } while (node != head);
+}
+
 /* Reverse elements in queue */
 void q_reverse(struct list_head *head)
 {
     if (!head || head->next == head->prev) {
         return;
     }
-    struct list_head *tmp;
-    for (struct list_head *next_ptr = head->next->next; next_ptr != head;
-         next_ptr = tmp) {
-        tmp = next_ptr->next;
-        list_move(next_ptr, head);
-    }
+    index_invalidate(head);
+    list_reverse(head);
 }
 
-/* Reverse the nodes of the list k at a time */
+/* Reverse the nodes of the list k at a time.
+ *
+ * Each group is reversed in place while walking it, by exchanging next and
+ * prev of every node and then fixing the four links at the group boundaries.
+ * Group ends are not searched in advance: should the last group turn out to be
+ * shorter than k, its nodes are swapped back, which costs less than k steps.
+ */
 void q_reverseK(struct list_head *head, int k)
 {
-    if (!head || k == 1 || head->prev == head->next) {
+    if (!head || k <= 1 || head->prev == head->next) {
         return;
     }
+    index_invalidate(head);
+
+    /* Last node of the already reversed part */
+    struct list_head *tail = head;
+    while (tail->next != head) {
+        struct list_head *first = tail->next, *node = first;
+        int n;
+        for (n = 0; n < k && node != head; n++) {
+            struct list_head *next = node->next;
+            node->next = node->prev;
+            node->prev = next;
+            node = next;
+        }
 
-    for (struct list_head *group_first = head;;) {
-        struct list_head *group_last = group_first;
-        int check = 0;
-        for (int i = 0; i < k; i++) {
-            group_last = group_last->next;
-            if (group_last == head) {
-                check = 1;
-                break;
+        if (n < k) {
+            for (struct list_head *pos = first; pos != head;) {
+                struct list_head *next = pos->prev;
+                pos->prev = pos->next;
+                pos->next = next;
+                pos = next;
             }
-        }
-        if (check == 1) {
             break;
         }
-        struct list_head *tmp_next = group_last->next;
-        struct list_head *tmp_prev = group_first->prev;
-        group_last->next = group_first;
-        group_first->prev = group_last;
-
-        q_reverse(group_first);
 
-        tmp_next->prev = group_first->prev;
-        group_first->prev->next = tmp_next;
-        struct list_head *tmp = group_first->prev;
-        group_first->prev = tmp_prev;
-        group_first = tmp;
+        /* node follows the group, its prev still points to the group end */
+        struct list_head *last = node->prev;
+        tail->next = last;
+        last->prev = tail;
+        first->next = node;
+        node->prev = first;
+        tail = first;
     }
 }
 
@@ -283,6 +605,7 @@ void q_sort(struct list_head *head, bool descend)
     if (!head || head->next == head->prev) {
         return;
     }
+    index_invalidate(head);
     int count = 0, count_compare = 1;
     struct list_head *pending = NULL, *list = head->next, *merge_first,
                      *merge_last, *merge_last_prev, *merge_head;
@@ -350,20 +673,19 @@ int q_ascend(struct list_head *head)
     if (head->next == head->prev) {
         return 1;
     }
-    struct list_head *pos, *pos_next;
-    for (pos = head->next; pos != head; pos = pos->next) {
-        const char *pos_val = list_entry(pos, element_t, list)->value;
-        for (pos_next = pos->next; pos_next != head;
-             pos_next = pos_next->next) {
-            if (strcmp(pos_val, list_entry(pos_next, element_t, list)->value) >
-                0) {
-                struct list_head *tmp = pos;
-                pos = pos->prev;
-                list_del(tmp);
-                free(list_entry(tmp, element_t, list)->value);
-                free(list_entry(tmp, element_t, list));
-                break;
-            }
+    index_invalidate(head);
+    /* Walk from the right, keeping the smallest value seen so far */
+    const char *bound = list_entry(head->prev, element_t, list)->value;
+    struct list_head *pos = head->prev->prev;
+    while (pos != head) {
+        element_t *e = list_entry(pos, element_t, list);
+        pos = pos->prev;
+        if (strcmp(e->value, bound) > 0) {
+            list_del(&e->list);
+            free(e->value);
+            free(e);
+        } else {
+            bound = e->value;
         }
     }
     return q_size(head);
@@ -379,20 +701,19 @@ int q_descend(struct list_head *head)
     if (head->next == head->prev) {
         return 1;
     }
-    struct list_head *pos, *pos_next;
-    for (pos = head->next; pos != head; pos = pos->next) {
-        const char *pos_val = list_entry(pos, element_t, list)->value;
-        for (pos_next = pos->next; pos_next != head;
-             pos_next = pos_next->next) {
-            if (strcmp(pos_val, list_entry(pos_next, element_t, list)->value) <
-                0) {
-                struct list_head *tmp = pos;
-                pos = pos->prev;
-                list_del(tmp);
-                free(list_entry(tmp, element_t, list)->value);
-                free(list_entry(tmp, element_t, list));
-                break;
-            }
+    index_invalidate(head);
+    /* Walk from the right, keeping the greatest value seen so far */
+    const char *bound = list_entry(head->prev, element_t, list)->value;
+    struct list_head *pos = head->prev->prev;
+    while (pos != head) {
+        element_t *e = list_entry(pos, element_t, list);
+        pos = pos->prev;
+        if (strcmp(e->value, bound) < 0) {
+            list_del(&e->list);
+            free(e->value);
+            free(e);
+        } else {
+            bound = e->value;
         }
     }
     return q_size(head);
@@ -417,33 +738,109 @@ int q_merge(struct list_head *head, bool descend)
         struct list_head *queue =
             list_entry(queue_ptr, queue_contex_t, chain)->q;
 
+        /* Elements keep living in the arena they were carved from */
+        queue_t *from = to_queue(queue), *to = to_queue(first_queue);
+        bool mixed = q_has_heap_elements(from) || q_has_heap_elements(to);
+        if (from->arena) {
+            if (to->arena) {
+                test_arena_merge(to->arena, from->arena);
+            } else {
+                to->arena = from->arena;
+            }
+            from->arena = NULL;
+        }
+        to->mixed = to->arena && mixed;
+
         list_splice_init(queue, first_queue);
+        index_invalidate(queue);
         list_entry(queue_ptr, queue_contex_t, chain)->size = 0;
         queue_ptr = queue_ptr->next;
     }
+    index_invalidate(first_queue);
     q_sort(first_queue, descend);
-    list_entry(first_queue, queue_contex_t, chain)->size = q_size(first_queue);
-    return list_entry(first_queue, queue_contex_t, chain)->size;
+    list_entry(head->next, queue_contex_t, chain)->size = q_size(first_queue);
+    return list_entry(head->next, queue_contex_t, chain)->size;
 }
 
+/* Shuffle the queue with the Fisher-Yates algorithm. Picking the k-th of the
+ * remaining nodes goes through the index, making the shuffle O(n log n).
+ * Should the index not be built, the nodes are picked by walking the list
+ * instead, in O(n^2), drawing the same random numbers.
+ */
 void q_shuffle(struct list_head *head)
 {
     if (!head || list_empty(head) || head->next == head->prev) {
         return;
     }
-    int size = q_size(head);
-    struct list_head *node = NULL;
-
-    while (size > 0) {
-        int random = rand() % size;
-        node = head->next;
-        while (random > 0) {
-            node = node->next;
-            random--;
+    queue_t *q = to_queue(head);
+    if (!index_build(q)) {
+        for (int size = q_size(head); size > 0; size--) {
+            struct list_head *node = head->next;
+            for (int k = rand() % size; k > 0; k--)
+                node = node->next;
+            list_move_tail(node, head);
         }
-        list_del(node);
-        list_add_tail(node, head);
-        size--;
+        return;
     }
-    return;
+
+    for (int size = q->root->size; size > 0; size--) {
+        struct list_head *node = index_remove(q, rand() % size);
+        list_move_tail(node, head);
+    }
+    index_invalidate(head);
+}
+
+/* Return the element at position index of queue */
+element_t *q_get(struct list_head *head, int index)
+{
+    if (!head || index < 0 || list_empty(head)) {
+        return NULL;
+    }
+    queue_t *q = to_queue(head);
+    if (!index_build(q)) {
+        return NULL;
+    }
+
+    rank_node_t *node = rank_find(q->root, index);
+    return node ? list_entry(node->list, element_t, list) : NULL;
+}
+
+/* Delete the element at position index of queue */
+bool q_delete_at(struct list_head *head, int index)
+{
+    if (!head || index < 0 || list_empty(head)) {
+        return false;
+    }
+    queue_t *q = to_queue(head);
+    if (!index_build(q) || index >= q->root->size) {
+        return false;
+    }
+
+    struct list_head *node = index_remove(q, index);
+    list_del(node);
+    q_release_element(list_entry(node, element_t, list));
+    return true;
+}
+
+/* Insert an element at position index of queue */
+bool q_insert_at(struct list_head *head, int index, char *s)
+{
+    if (!head || !s || index < 0) {
+        return false;
+    }
+    queue_t *q = to_queue(head);
+    if (!index_build(q) || index > rank_size(q->root)) {
+        return false;
+    }
+
+    element_t *new_element = element_new(to_queue(head), s);
+    if (!new_element) {
+        return false;
+    }
+
+    /* The new element goes right before the one currently at index */
+    rank_node_t *next = rank_find(q->root, index);
+    list_add_tail(&new_element->list, next ? next->list : head);
+    index_insert(q, index, &new_element->list);
+    return true;
 }
@@ -48,6 +48,17 @@ typedef struct {
  */
 struct list_head *q_new();
 
+/**
+ * q_new_arena() - Create an empty queue whose elements come from an arena
+ *
+ * Elements of such a queue are released one by one as usual when deleted, but
+ * q_free() gives the storage of all remaining ones back at once, in time
+ * proportional to the number of arena chunks rather than of elements.
+ *
+ * Return: NULL for allocation failed
+ */
+struct list_head *q_new_arena();
+
 /**
  * q_free() - Free all storage used by queue, no effect if header is NULL
  * @head: header of queue
@@ -252,4 +263,44 @@ int q_descend(struct list_head *head);
  */
 int q_merge(struct list_head *head, bool descend);
 
+/* Positional access
+ *
+ * The following operations are served by an order-statistic index kept
+ * alongside the list. Any other operation changing the queue marks the index
+ * stale, and the next positional operation rebuilds it in O(n). As long as the
+ * queue is only changed through these operations, each of them runs in
+ * O(log n).
+ */
+
+/**
+ * q_get() - Get the element at a given position of queue
+ * @head: header of queue
+ * @index: 0-based position counted from the head
+ *
+ * Return: the pointer to element, %NULL if queue is NULL, @index is out of
+ * range or the index could not be allocated.
+ */
+element_t *q_get(struct list_head *head, int index);
+
+/**
+ * q_delete_at() - Delete the element at a given position of queue
+ * @head: header of queue
+ * @index: 0-based position counted from the head
+ *
+ * Return: true for success, false if queue is NULL, @index is out of range or
+ * the index could not be allocated.
+ */
+bool q_delete_at(struct list_head *head, int index);
+
+/**
+ * q_insert_at() - Insert an element at a given position of queue
+ * @head: header of queue
+ * @index: 0-based position the new element will occupy, up to the queue size
+ * @s: string would be inserted
+ *
+ * Return: true for success, false for allocation failed, queue is NULL or
+ * @index is out of range.
+ */
+bool q_insert_at(struct list_head *head, int index, char *s);
+
 #endif /* LAB0_QUEUE_H */
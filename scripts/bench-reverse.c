@@ -0,0 +1,115 @@
+/* Micro-benchmark of list reversal, run by scripts/perf.py.
+ *
+ * Compares moving every node to the front of the list, as q_reverse used to,
+ * with swapping next and prev of every node, as it does now. Nodes are linked
+ * in the order they sit in memory, then in a random order, where every step
+ * of the walk misses the cache whatever the reversal does.
+ *
+ * Usage: bench-reverse [N ...], N nodes per list (default 1000000 10000000)
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "list.h"
+
+#define RUNS 3
+
+static void reverse_move(struct list_head *head)
+{
+    struct list_head *tmp;
+    for (struct list_head *next_ptr = head->next->next; next_ptr != head;
+         next_ptr = tmp) {
+        tmp = next_ptr->next;
+        list_move(next_ptr, head);
+    }
+}
+
+static void reverse_swap(struct list_head *head)
+{
+    struct list_head *node = head;
+    do {
+        struct list_head *next = node->next;
+        node->next = node->prev;
+        node->prev = next;
+        node = next;
+    } while (node != head);
+}
+
+/* Link nodes[0, n) into head, in memory order or shuffled */
+static void link_nodes(struct list_head *head,
+                       struct list_head *nodes,
+                       size_t n,
+                       bool scattered)
+{
+    size_t *order = malloc(n * sizeof(size_t));
+    if (!order) {
+        perror("malloc");
+        exit(1);
+    }
+    for (size_t i = 0; i < n; i++)
+        order[i] = i;
+    for (size_t i = n - 1; scattered && i > 0; i--) {
+        size_t j = (size_t) rand() % (i + 1);
+        size_t tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+
+    INIT_LIST_HEAD(head);
+    for (size_t i = 0; i < n; i++)
+        list_add_tail(&nodes[order[i]], head);
+    free(order);
+}
+
+/* Best time of several reversals, in milliseconds */
+static double time_reverse(void (*reverse)(struct list_head *),
+                           struct list_head *head)
+{
+    double best = 0;
+    for (int run = 0; run < RUNS; run++) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        reverse(head);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double ms = (end.tv_sec - start.tv_sec) * 1e3 +
+                    (end.tv_nsec - start.tv_nsec) / 1e6;
+        if (!run || ms < best)
+            best = ms;
+    }
+    return best;
+}
+
+static void bench(size_t n)
+{
+    struct list_head *nodes = malloc(n * sizeof(struct list_head));
+    if (!nodes) {
+        perror("malloc");
+        exit(1);
+    }
+
+    struct list_head head;
+    for (int scattered = 0; scattered <= 1; scattered++) {
+        link_nodes(&head, nodes, n, scattered);
+        double move = time_reverse(reverse_move, &head);
+        double swap = time_reverse(reverse_swap, &head);
+        printf("%10zu %-10s %12.1f %12.1f\n", n,
+               scattered ? "scattered" : "sequential", move, swap);
+    }
+    free(nodes);
+}
+
+int main(int argc, char *argv[])
+{
+    printf("%10s %-10s %12s %12s\n", "Nodes", "Layout", "Move (ms)",
+           "Swap (ms)");
+    if (argc < 2) {
+        bench(1000000);
+        bench(10000000);
+    }
+    for (int i = 1; i < argc; i++)
+        bench(strtoul(argv[i], NULL, 10));
+    return 0;
+}
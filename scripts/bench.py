@@ -0,0 +1,194 @@
+#!/usr/bin/env python3
+
+from __future__ import print_function
+import getopt
+import json
+import os
+import subprocess
+import sys
+import tempfile
+
+
+# Benchmark driver: runs traces/bench-1eK.cmd for each size 10^K, reads the
+# per-command records qtest writes with -j, and compares the throughput of
+# each queue operation with a baseline
+class Bench:
+
+    traceDirectory = "./traces"
+    qtest = "./qtest"
+    baseline = "./traces/bench-baseline.json"
+    sizes = [3, 4, 5, 6, 7]
+    tolerance = 20
+    runs = 3
+    update = False
+
+    # Operations shorter than this, in ns, are too noisy to be flagged
+    minimum = 100000
+
+    # Setup commands, not benchmarked
+    skipped = ["#", "option", "new", "free", "quit"]
+
+    def __init__(self, qtest="", baseline="", sizes=None, tolerance=None,
+                 runs=None, update=False):
+        if qtest != "":
+            self.qtest = qtest
+        if baseline != "":
+            self.baseline = baseline
+        if sizes is not None:
+            self.sizes = sizes
+        if tolerance is not None:
+            self.tolerance = tolerance
+        if runs is not None:
+            self.runs = runs
+        self.update = update
+
+    # Return the throughput in elements per second and the elapsed time in ns
+    # of every operation, by "op@1eK", or None on failure
+    def runTrace(self, exp):
+        fname = "%s/bench-1e%d.cmd" % (self.traceDirectory, exp)
+        fd, jname = tempfile.mkstemp(suffix=".json")
+        os.close(fd)
+        clist = [self.qtest, "-v", "0", "-f", fname, "-j", jname]
+        try:
+            retcode = subprocess.call(clist)
+            with open(jname) as f:
+                records = json.load(f)
+        except Exception as e:
+            print("Call of '%s' failed: %s" % (" ".join(clist), e))
+            return None
+        finally:
+            os.remove(jname)
+        if retcode != 0:
+            print("Trace %s failed" % fname)
+            return None
+
+        results = {}
+        size = 0
+        for r in records:
+            before, size = size, r["queue_size"]
+            op = r["command"]
+            if op in self.skipped:
+                continue
+            if op == "repeat":
+                op = r["args"][1]
+            key = "%s@1e%d" % (op, exp)
+            # Operations run more than once are told apart by their rank
+            rank = 2
+            while key in results:
+                key = "%s#%d@1e%d" % (op, rank, exp)
+                rank += 1
+            elements = self.elements(op, before, size)
+            elapsed = max(r["elapsed_ns"], 1)
+            results[key] = (elements / elapsed * 1e9, elapsed)
+        return results
+
+    # Elements an operation touched, given the queue size before and after it:
+    # those it inserted or removed, all those of the queues merge gathered, or
+    # else all those of the queue
+    def elements(self, op, before, after):
+        if op in ["ih", "it", "rh", "rt"]:
+            return abs(after - before)
+        if op == "merge":
+            return after
+        return before
+
+    def run(self):
+        results = {}
+        elapsed = {}
+        for exp in self.sizes:
+            print("+++ Running bench-1e%d" % exp)
+            sys.stdout.flush()
+            # Keep the best of several runs, the others being slowed down by
+            # whatever else the machine was doing
+            for i in range(self.runs):
+                r = self.runTrace(exp)
+                if r is None:
+                    sys.exit(1)
+                for key, (value, ns) in r.items():
+                    if value > results.get(key, 0):
+                        results[key] = value
+                        elapsed[key] = ns
+
+        base = {}
+        if os.path.exists(self.baseline) and not self.update:
+            with open(self.baseline) as f:
+                base = json.load(f)
+
+        regressions = 0
+        print("%-16s %14s %14s %8s" % ("Operation", "Elements/s", "Baseline",
+                                       "Change"))
+        for key, value in results.items():
+            if key not in base:
+                print("%-16s %14.0f" % (key, value))
+                continue
+            change = (value / base[key] - 1) * 100
+            flag = ""
+            if change < -self.tolerance and elapsed[key] >= self.minimum:
+                flag = "  REGRESSION"
+                regressions += 1
+            print("%-16s %14.0f %14.0f %+7.1f%%%s" %
+                  (key, value, base[key], change, flag))
+
+        if self.update or not base:
+            base.update(results)
+            with open(self.baseline, "w") as f:
+                json.dump(base, f, indent=2, sort_keys=True)
+                f.write("\n")
+            print("Recorded baseline in %s" % self.baseline)
+        elif regressions:
+            print("%d operations slowed down by more than %d%%" %
+                  (regressions, self.tolerance))
+            sys.exit(1)
+
+
+def usage(name):
+    print("Usage: %s [-h] [-p PROG] [-b FILE] [-s SIZES] [-t PCT] [-r RUNS]"
+          " [-u]" % name)
+    print("  -h        Print this message")
+    print("  -p PROG   Program to test")
+    print("  -b FILE   Baseline file, recorded on first run")
+    print("  -s SIZES  Powers of ten, comma-separated (default 3,4,5,6,7)")
+    print("  -t PCT    Tolerated slowdown against baseline (default 20)")
+    print("  -r RUNS   Runs of each trace, keeping the best (default 3)")
+    print("  -u        Record results as the new baseline")
+    sys.exit(0)
+
+
+def run(name, args):
+    prog = ""
+    baseline = ""
+    sizes = None
+    tolerance = None
+    runs = None
+    update = False
+
+    optlist, args = getopt.getopt(args, 'hp:b:s:t:r:u')
+    for (opt, val) in optlist:
+        if opt == '-h':
+            usage(name)
+        elif opt == '-p':
+            prog = val
+        elif opt == '-b':
+            baseline = val
+        elif opt == '-s':
+            sizes = [int(s) for s in val.split(",")]
+        elif opt == '-t':
+            tolerance = float(val)
+        elif opt == '-r':
+            runs = int(val)
+        elif opt == '-u':
+            update = True
+        else:
+            print("Unrecognized option '%s'" % opt)
+            usage(name)
+    b = Bench(qtest=prog,
+              baseline=baseline,
+              sizes=sizes,
+              tolerance=tolerance,
+              runs=runs,
+              update=update)
+    b.run()
+
+
+if __name__ == "__main__":
+    run(sys.argv[0], sys.argv[1:])
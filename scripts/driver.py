@@ -4,6 +4,9 @@ from __future__ import print_function
 import subprocess
 import sys
 import getopt
+import os
+import tempfile
+import time
 
 
 
@@ -17,6 +20,7 @@ class Tracer:
     autograde = False
     useValgrind = False
     colored = False
+    fastOverhead = False
 
     traceDict = {
         1: "trace-01-ops",
@@ -35,7 +39,17 @@ class Tracer:
         14: "trace-14-perf",
         15: "trace-15-perf",
         16: "trace-16-perf",
-        17: "trace-17-complexity"
+        17: "trace-17-complexity",
+        18: "trace-18-index",
+        19: "trace-19-perf",
+        20: "trace-20-arena"
+    }
+
+    # Traces checking the harness rather than the queue, run along with the
+    # others but left out of the score
+    harnessDict = {
+        21: "trace-21-realloc",
+        22: "trace-22-threads"
     }
 
     traceProbs = {
@@ -55,10 +69,14 @@ class Tracer:
         14: "Trace-14",
         15: "Trace-15",
         16: "Trace-16",
-        17: "Trace-17"
+        17: "Trace-17",
+        18: "Trace-18",
+        19: "Trace-19",
+        20: "Trace-20"
     }
 
-    maxScores = [0, 5, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 5]
+    # Indexed by trace id, nothing for the harness traces
+    maxScores = [0, 5, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 5, 6, 6, 6, 0, 0]
 
     RED = '\033[91m'
     GREEN = '\033[92m'
@@ -69,24 +87,31 @@ class Tracer:
                  verbLevel=0,
                  autograde=False,
                  useValgrind=False,
-                 colored=False):
+                 colored=False,
+                 fastOverhead=False):
         if qtest != "":
             self.qtest = qtest
         self.verbLevel = verbLevel
         self.autograde = autograde
         self.useValgrind = useValgrind
         self.colored = colored
+        self.fastOverhead = fastOverhead
 
     def printInColor(self, text, color):
         if self.colored == False:
             color = self.WHITE
         print(color, text, self.WHITE, sep = '')
 
+    def traceName(self, tid):
+        if tid in self.traceDict:
+            return self.traceDict[tid]
+        return self.harnessDict.get(tid)
+
     def runTrace(self, tid):
-        if not tid in self.traceDict:
+        if not self.traceName(tid):
             self.printInColor("ERROR: No trace with id %d" % tid, self.RED)
             return False
-        fname = "%s/%s.cmd" % (self.traceDirectory, self.traceDict[tid])
+        fname = "%s/%s.cmd" % (self.traceDirectory, self.traceName(tid))
         vname = "%d" % self.verbLevel
         clist = self.command + ["-v", vname, "-f", fname]
 
@@ -97,16 +122,41 @@ class Tracer:
             return False
         return retcode == 0
 
+    # Time a trace in fast mode, then in checked mode, with no time limit.
+    # Returns both times in seconds.
+    def timeFastMode(self, tid):
+        fname = "%s/%s.cmd" % (self.traceDirectory, self.traceName(tid))
+        with open(fname) as f:
+            lines = [l for l in f if l.split()[:2] != ["option", "fast"]]
+        times = []
+        for fast in [1, 0]:
+            fd, tname = tempfile.mkstemp(suffix=".cmd")
+            with os.fdopen(fd, "w") as f:
+                f.write("option timelimit 0\noption fast %d\n" % fast)
+                f.writelines(lines)
+            start = time.monotonic()
+            try:
+                subprocess.call(self.command + ["-v", "0", "-f", tname])
+            finally:
+                os.remove(tname)
+            times.append(time.monotonic() - start)
+        return times
+
     def run(self, tid=0):
         scoreDict = {k: 0 for k in self.traceDict.keys()}
         print("---\tTrace\t\tPoints")
         if tid == 0:
             tidList = self.traceDict.keys()
-        else:
-            if not tid in self.traceDict:
-                self.printInColor("ERROR: Invalid trace ID %d" % tid, self.RED)
-                return
+            harnessList = self.harnessDict.keys()
+        elif tid in self.traceDict:
             tidList = [tid]
+            harnessList = []
+        elif tid in self.harnessDict:
+            tidList = []
+            harnessList = [tid]
+        else:
+            self.printInColor("ERROR: Invalid trace ID %d" % tid, self.RED)
+            return
         score = 0
         maxscore = 0
         if self.useValgrind:
@@ -124,13 +174,26 @@ class Tracer:
                 self.printInColor("---\t%s\t%d/%d" % (tname, tval, maxval), self.RED)
             else:
                 self.printInColor("---\t%s\t%d/%d" % (tname, tval, maxval), self.GREEN)
+            if self.fastOverhead:
+                fast, checked = self.timeFastMode(t)
+                print("+++\t%s\tfast %.2f s, checked %.2f s, saving %.0f%%" %
+                      (tname, fast, checked, (1 - fast / max(checked, 1e-9)) * 100))
             score += tval
             maxscore += maxval
             scoreDict[t] = tval
-        if score < maxscore:
-            self.printInColor("---\tTOTAL\t\t%d/%d" % (score, maxscore), self.RED)
-        else:
-            self.printInColor("---\tTOTAL\t\t%d/%d" % (score, maxscore), self.GREEN)
+        harnessFailures = 0
+        for t in harnessList:
+            tname = self.harnessDict[t]
+            if self.verbLevel > 0:
+                print("+++ TESTING harness with trace %s:" % tname)
+            if self.runTrace(t):
+                self.printInColor("---\t%s\tok" % tname, self.GREEN)
+            else:
+                self.printInColor("---\t%s\tFAILED" % tname, self.RED)
+                harnessFailures += 1
+        if tidList:
+            color = self.RED if score < maxscore else self.GREEN
+            self.printInColor("---\tTOTAL\t\t%d/%d" % (score, maxscore), color)
         if self.autograde:
             # Generate JSON string
             jstring = '{"scores": {'
@@ -142,16 +205,17 @@ class Tracer:
                 jstring += '"%s" : %d' % (self.traceProbs[k], scoreDict[k])
             jstring += '}}'
             print(jstring)
-        if score < maxscore:
+        if score < maxscore or harnessFailures:
             sys.exit(1)
 
 def usage(name):
-    print("Usage: %s [-h] [-p PROG] [-t TID] [-v VLEVEL] [--valgrind] [-c]" % name)
+    print("Usage: %s [-h] [-p PROG] [-t TID] [-v VLEVEL] [--valgrind] [-c] [-f]" % name)
     print("  -h        Print this message")
     print("  -p PROG   Program to test")
     print("  -t TID    Trace ID to test")
     print("  -v VLEVEL Set verbosity level (0-3)")
     print("  -c Enable colored text")
+    print("  -f Time each trace with and without fast mode")
     sys.exit(0)
 
 
@@ -163,8 +227,9 @@ def run(name, args):
     autograde = False
     useValgrind = False
     colored = False
+    fastOverhead = False
 
-    optlist, args = getopt.getopt(args, 'hp:t:v:A:c', ['valgrind'])
+    optlist, args = getopt.getopt(args, 'hp:t:v:A:cf', ['valgrind'])
     for (opt, val) in optlist:
         if opt == '-h':
             usage(name)
@@ -181,6 +246,8 @@ def run(name, args):
             useValgrind = True
         elif opt == '-c':
             colored = True
+        elif opt == '-f':
+            fastOverhead = True
         else:
             print("Unrecognized option '%s'" % opt)
             usage(name)
@@ -190,7 +257,8 @@ def run(name, args):
                verbLevel=vlevel,
                autograde=autograde,
                useValgrind=useValgrind,
-               colored=colored)
+               colored=colored,
+               fastOverhead=fastOverhead)
     t.run(tid)
 
 
@@ -0,0 +1,169 @@
+#!/usr/bin/env python3
+
+from __future__ import print_function
+import getopt
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+
+# Benchmarks that fall outside the per-operation traces of scripts/bench.py.
+# Interpreter benchmarks time every program given with -p, so that qtest built
+# from an earlier commit can be compared with the current one:
+#
+#   git worktree add /tmp/base <commit> && make -C /tmp/base qtest
+#   scripts/perf.py -p ./qtest -p /tmp/base/qtest replay
+#
+#   reverse  Moving every node to the front against swapping links, on 10^6
+#            and 10^7 nodes, with scripts/bench-reverse.c
+#   replay   Replaying 10^7 alternating 'size' and 'option' lines, dominated
+#            by looking the commands up
+#   words    Replaying 10^7 comment lines of eight words, dominated by
+#            splitting them into arguments
+#   input    Replaying a 100 MB script of long lines, dominated by reading
+#            them
+class Perf:
+
+    progs = ["./qtest"]
+    benchmarks = ["reverse", "replay", "words", "input"]
+    commands = 10000000
+    megabytes = 100
+    runs = 3
+
+    def __init__(self, progs=None, commands=None, megabytes=None, runs=None):
+        if progs:
+            self.progs = progs
+        if commands is not None:
+            self.commands = commands
+        if megabytes is not None:
+            self.megabytes = megabytes
+        if runs is not None:
+            self.runs = runs
+        self.tmpdir = tempfile.mkdtemp()
+
+    def reverse(self):
+        print("+++ Reversing lists of nodes")
+        exe = os.path.join(self.tmpdir, "bench-reverse")
+        clist = ["cc", "-O1", "-I.", "scripts/bench-reverse.c", "-o", exe]
+        if subprocess.call(clist) != 0:
+            print("Call of '%s' failed" % " ".join(clist))
+            return False
+        return subprocess.call([exe]) == 0
+
+    # Write a script repeating cycle, a string of lines, count times over
+    def script(self, name, cycle, count):
+        fname = os.path.join(self.tmpdir, name)
+        with open(fname, "w") as f:
+            f.write("option fail 0\noption malloc 0\nnew\n")
+            for i in range(count):
+                f.write(cycle)
+            f.write("free\n")
+        return fname
+
+    # Best wall-clock time of replaying fname, in seconds, None on failure
+    def timeScript(self, prog, fname):
+        best = None
+        for i in range(self.runs):
+            clist = [prog, "-v", "0", "-f", fname]
+            start = time.time()
+            retcode = subprocess.call(clist, stdout=subprocess.DEVNULL)
+            elapsed = time.time() - start
+            if retcode != 0:
+                print("Call of '%s' failed" % " ".join(clist))
+                return None
+            if best is None or elapsed < best:
+                best = elapsed
+        return best
+
+    def interpret(self, title, fname):
+        print("+++ Replaying %s (%.0f MB)" %
+              (title, os.path.getsize(fname) / (1 << 20)))
+        sys.stdout.flush()
+        for prog in self.progs:
+            elapsed = self.timeScript(prog, fname)
+            if elapsed is None:
+                return False
+            print("%-30s %8.2f s" % (prog, elapsed))
+            sys.stdout.flush()
+        os.remove(fname)
+        return True
+
+    def replay(self):
+        fname = self.script("replay.cmd", "size\noption echo 0\n",
+                            self.commands // 2)
+        return self.interpret("%d commands" % self.commands, fname)
+
+    def words(self):
+        fname = self.script("words.cmd", "# a b c d e f g\n", self.commands)
+        return self.interpret("%d lines of words" % self.commands, fname)
+
+    def input(self):
+        pair = "ih %s\nrh\n" % ("x" * 250)
+        fname = self.script("input.cmd", pair,
+                            self.megabytes * (1 << 20) // len(pair))
+        return self.interpret("long lines", fname)
+
+    def run(self, benchmarks):
+        ok = True
+        try:
+            for b in benchmarks or self.benchmarks:
+                if b == "reverse":
+                    ok = self.reverse() and ok
+                elif b == "replay":
+                    ok = self.replay() and ok
+                elif b == "words":
+                    ok = self.words() and ok
+                elif b == "input":
+                    ok = self.input() and ok
+                else:
+                    print("Unknown benchmark '%s'" % b)
+                    ok = False
+        finally:
+            shutil.rmtree(self.tmpdir)
+        if not ok:
+            sys.exit(1)
+
+
+def usage(name):
+    print("Usage: %s [-h] [-p PROG]... [-n CMDS] [-m MB] [-r RUNS] "
+          "[BENCHMARK]..." % name)
+    print("  -h        Print this message")
+    print("  -p PROG   Program to time, may be repeated (default ./qtest)")
+    print("  -n CMDS   Commands replayed by 'replay' and 'words' "
+          "(default 10000000)")
+    print("  -m MB     Size of the script replayed by 'input' (default 100)")
+    print("  -r RUNS   Runs of each script, keeping the best (default 3)")
+    print("  BENCHMARK reverse, replay, words or input (default all of them)")
+    sys.exit(0)
+
+
+def run(name, args):
+    progs = []
+    commands = None
+    megabytes = None
+    runs = None
+
+    optlist, args = getopt.getopt(args, 'hp:n:m:r:')
+    for (opt, val) in optlist:
+        if opt == '-h':
+            usage(name)
+        elif opt == '-p':
+            progs.append(val)
+        elif opt == '-n':
+            commands = int(val)
+        elif opt == '-m':
+            megabytes = int(val)
+        elif opt == '-r':
+            runs = int(val)
+        else:
+            print("Unrecognized option '%s'" % opt)
+            usage(name)
+    p = Perf(progs=progs, commands=commands, megabytes=megabytes, runs=runs)
+    p.run(args)
+
+
+if __name__ == "__main__":
+    run(sys.argv[0], sys.argv[1:])
@@ -0,0 +1,20 @@
+# Benchmark queue operations on 1e5 elements, run by scripts/bench.py
+option fail 0
+option malloc 0
+option fast 1
+option timelimit 0
+new
+it RAND 100000
+reverse
+reverseK 3
+swap
+shuffle
+sort
+dedup
+new
+it RAND 100000
+sort
+merge
+repeat 100000 rh
+ascend
+free
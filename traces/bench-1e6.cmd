@@ -0,0 +1,20 @@
+# Benchmark queue operations on 1e6 elements, run by scripts/bench.py
+option fail 0
+option malloc 0
+option fast 1
+option timelimit 0
+new
+it RAND 1000000
+reverse
+reverseK 3
+swap
+shuffle
+sort
+dedup
+new
+it RAND 1000000
+sort
+merge
+repeat 1000000 rh
+ascend
+free
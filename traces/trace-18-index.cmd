@@ -0,0 +1,27 @@
+# Test of positional access: get, delat, insat, and dm on an indexed queue
+option fail 0
+option malloc 0
+new
+it a
+it b
+it c
+it d
+it e
+get 0
+get 4
+delat 2
+get 2
+insat 0 z
+insat 5 y
+insat 3 m
+get 3
+dm
+get 3
+it f
+get 6
+reverse
+get 0
+delat 0
+delat 5
+size
+free
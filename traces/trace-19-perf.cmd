@@ -0,0 +1,18 @@
+# Test performance of reverseK with group sizes from 2 up to 1000
+option fail 0
+option malloc 0
+option fast 1
+new
+ih dolphin 500000
+it gerbil 500000
+reverseK 2
+reverseK 3
+reverseK 5
+reverseK 8
+reverseK 16
+reverseK 64
+reverseK 100
+reverseK 256
+reverseK 512
+reverseK 999
+reverseK 1000
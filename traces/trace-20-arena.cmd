@@ -0,0 +1,34 @@
+# Test of arena-backed queues, including merging with heap-backed ones
+option fail 0
+option malloc 0
+option arena 1
+new
+ih gerbil
+ih bear
+it dolphin
+rh bear
+sort
+option arena 0
+new
+ih meerkat
+it zebra
+option arena 1
+new
+ih aardvark
+merge
+rh aardvark
+rt zebra
+size
+free
+new
+ih fox 100
+loop 1000
+ih RAND 10
+rh
+repeat 9 rh
+end
+free
+new
+ih dolphin 100000
+it gerbil 100000
+free
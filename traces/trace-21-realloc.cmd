@@ -0,0 +1,18 @@
+# Test of resizing blocks, in place or moved, including failed attempts
+option fail 0
+option malloc 0
+realloc 10 100 20 1000 5 5000
+option failnth 3
+realloc 10 100 20 1000
+option failnth 0
+option arena 1
+realloc 10 100 20 100 30 2000000 60
+option failnth 3
+realloc 10 100 20
+option failnth 0
+option arena 0
+option fast 1
+realloc 10 100 20 1000
+option fast 0
+option guard 1
+realloc 10 5000 20
@@ -0,0 +1,19 @@
+# Test of allocating and freeing from several threads at once
+option fail 0
+option malloc 0
+threads 4 100000
+option fast 1
+threads 4 100000
+option fast 0
+option quarantine 100
+option guard 50
+option profile 1
+threads 4 20000
+option profile 0
+option guard 0
+option quarantine 0
+option failevery 7
+threads 4 20000
+option failevery 0
+option failnth 1000
+threads 8 1000